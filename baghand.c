@@ -1,133 +1,28 @@
 // Baghand - zip to gz.tar converter. Converts a zip file to a tarball of gzipped files without decompressing anything.
+// The conversions themselves are in libbaghand.c, this is the command line.
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 
-//wow, I didn't realize tarball headers were so huge, or all in ascii...
-struct tar_posix_header
-{
-	unsigned char name[100];
-	unsigned char mode[8];
-	unsigned char uid[8];
-	unsigned char gid[8];
-	unsigned char size[12];
-	unsigned char mtime[12];
-	unsigned char chksum[8];
-	unsigned char typeflag;
-	unsigned char linkname[100];
-	unsigned char magic[6];
-	unsigned char version[2];
-	unsigned char uname[32];
-	unsigned char gname[32];
-	unsigned char devmajor[8];
-	unsigned char devminor[8];
-	unsigned char prefix[155];
-	unsigned char pad[12];
-};
-
-#define GZ_MAGIC 0x8b1f
-#define GZ_METHOD_DEFLATE 0x08
-#define GZ_OS_LINUX 0x03
-
-#define GZ_FLAGS_TEXT       0x01 // ascii?
-#define GZ_FLAGS_HEADER_CRC 0x02
-#define GZ_FLAGS_EXTRA      0x04
-#define GZ_FLAGS_NAME_TRUNC 0x08
-#define GZ_FLAGS_ENCRYPTED  0x10
-#define GZ_FLAGS_RESTRICTED 0xE0
-
-struct gz_header
-{
-	uint16_t magic;
-	uint8_t  method;
-	uint8_t  flags; //encrypted, restricted, extra_feild, header_crc, truncated_name
-	uint32_t stamp;
-	uint8_t  extra;
-	uint8_t  os;
-}__attribute__((packed));
-
-struct gz_footer
-{
-	uint32_t crc;
-	uint32_t isize;
-};
-
-#define ZIP_FILE_MAGIC 0x04034b50
-#define ZIP_ALG_STORE 0
-#define ZIP_ALG_DEFLATE 8
-#define ZIP_CD_MAGIC   0x02014b50
-#define ZIP_EOCD_MAGIC 0x06054b50
+#include "baghand.h"
 
-struct zip_local_file
-{
-	uint32_t magic;
-	uint16_t min_version;
-	uint16_t flags;
-	uint16_t compression;
-	uint16_t mtime;
-	uint16_t mdate;
-	uint32_t crc32;
-	uint32_t zip_size;
-	uint32_t unzip_size;
-	uint16_t fname_len;
-	uint16_t extra_len;
-	unsigned char *fname;
-	unsigned char *extra;
-}__attribute__((packed));
-
-struct zip_directory
-{
-	uint32_t magic;
-	uint16_t version;
-	uint16_t min_version;
-	uint16_t flags;
-	uint16_t compression;
-	uint16_t mtime;
-	uint16_t mdate;
-	uint32_t crc32;
-	uint32_t zip_size;
-	uint32_t unzip_size;
-	uint16_t fname_len;
-	uint16_t extra_len;
-	uint16_t comment_len;
-	uint16_t disk;
-	uint16_t iattr;
-	uint32_t eattr; // data alignment is the problem here...
-	uint32_t offset;
-	unsigned char *fname;
-	unsigned char *extra;
-	unsigned char *comment;
-}__attribute__((packed));
-
-struct zip_eocd
-{
-	uint32_t magic;
-	uint16_t disk_num;
-	uint16_t main_disk;
-	uint16_t central_records;
-	uint16_t total_central_records;
-	uint32_t central_dir_size;
-	uint32_t central_dir_offset;
-	uint16_t comment_len;
-	unsigned char *comment;
-};
-
-struct deflate_store_header
-{
-	uint8_t method;
-	uint16_t block_size;
-	uint16_t inverse_size;
-}__attribute__((packed));
+#define BH_MODE_MAKE_ZIP 'r' // the reverse, a tarball back to a zip
+#define BH_MODE_LOOKUP   'l' // one entry out of a tarball, through its index
 
-#define BH_MODE_MAKE_TAR 'c'
-#define BH_MODE_MAKE_TGZ 'z'
-#define BH_MODE_EXTRACT  'x'
+#define BH_OPT_MMAP 'm'
+#define BH_OPT_JOBS 'j'
+#define BH_OPT_STREAM 's'
+#define BH_OPT_URING 'u'
+#define BH_OPT_INDEX 'i'
+#define BH_OPT_INCLUDE 'n'
+#define BH_OPT_EXCLUDE 'e'
+#define BH_OPT_LIST 'f'
 
 void usage()
 {
@@ -137,380 +32,368 @@ void usage()
 	write(1, "Options:\n", 9);
 	write(1, "\t-c \t tar mode. Create a tarball of gzipped files. [default]\n", 61);
 	write(1, "\t-z \t tar.gz mode. Create a gzipped tarball.\n", 45);
+	write(1, "\t-Z \t like -z, but as a single gzip member instead of one per entry.\n", 69);
 	write(1, "\t-x \t extract mode. Extract the files to gzipped files.\n", 56);
+	write(1, "\t-r \t reverse mode. Turn the tar file (or tar.gz from -z) back into the zip file.\n", 82);
+	write(1, "\t-l NAME\t write entry NAME of the tar file to stdout, found through its index.\n", 79);
+	write(1, "\t-i \t also write an index of the tar file to <tar file>.idx, for -l.\n", 69);
+	write(1, "\t-m \t map the whole zip file into memory instead of reading it.\n", 64);
+	write(1, "\t-j N\t use N threads for -x and -c (0 for one per cpu). [1]\n", 60);
+	write(1, "\t-n GLOB\t only convert entries matching GLOB (can be repeated).\n", 64);
+	write(1, "\t-e GLOB\t leave out entries matching GLOB (can be repeated).\n", 61);
+	write(1, "\t-f FILE\t only convert the entries named in FILE, one per line.\n", 64);
+	write(1, "\t-s \t read the zip front to back without seeking. [zip file is -]\n", 66);
+	write(1, "\t--verify[=inflate]\t also check stored entries against their crc, or every entry.\n", 82);
+	write(1, "\t--stats[=json]\t print where the time went to stderr at the end, as text or JSON.\n", 82);
+	write(1, "\t--compress[=LEVEL]\t deflate stored entries too, for -z, -Z and -x, on every cpu. [6]\n", 86);
+	write(1, "\t--max-memory=N[KMG]\t cap the buffers entries are copied through, split over -j. [4M each]\n", 91);
+	write(1, "\t--dedup\t write entries that are the same as an earlier one as hard links to it.\n", 81);
+	write(1, "\t--from=TAR\t copy the entries that haven't changed from TAR, made earlier with -i.\n", 83);
+	write(1, "\t--physical[=read]\t go through the zip front to back, =read keeps directory order in -c.\n", 89);
+	write(1, "\t--batch[=LIST]\t convert many zips with -c, -z or -Z: the names are zip/tar file pairs,\n", 88);
+	write(1, "\t\t\t or LIST has one pair per line, a tab between them (- for stdin).\n", 69);
+#ifdef BH_IO_URING
+	write(1, "\t-u \t extract through io_uring, in batches.\n", 44);
+#endif
+	write(1, "\nA tar file of - writes the tarball to stdout.\n", 47);
 }
 
-
-// -------------------RFC1952 CRC code--------------------------
-
-/* Table of CRCs of all 8-bit messages. */
-static uint32_t crc_table[256];
-
-/* Flag: has the table been computed? Initially false. */
-int crc_table_computed = 0;
-
-/* Make the table for a fast CRC. */
-void make_crc_table(void)
-{
-	unsigned long c;
-	int n, k;
-	for (n = 0; n < 256; n++) {
-		  c = (unsigned long) n;
-		  for (k = 0; k < 8; k++) {
-		if (c & 1) {
-		  c = 0xedb88320L ^ (c >> 1);
-		} else {
-		  c = c >> 1;
-		}
-	  }
-	  crc_table[n] = c;
-	}
-	crc_table_computed = 1;
-}
-
-/*
- Update a running crc with the bytes buf[0..len-1] and return
-the updated crc. The crc should be initialized to zero. Pre- and
-post-conditioning (one's complement) is performed within this
-function so it shouldn't be done by the caller. Usage example:
-
- unsigned long crc = 0L;
-
- while (read_buffer(buffer, length) != EOF) {
-   crc = update_crc(crc, buffer, length);
- }
- if (crc != original_crc) error();
-*/
-uint32_t update_crc(uint32_t crc,
-			  unsigned char *buf, int len)
-{
-	uint32_t c = crc ^ 0xffffffffL;
-	int n;
-
-	if (!crc_table_computed)
-		make_crc_table();
-	for (n = 0; n < len; n++) {
-		c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
-	}
-	return c ^ 0xffffffffL;
-}
-
-/* Return the CRC of the bytes buf[0..len-1]. */
-inline uint32_t crc(unsigned char *buf, int len)
+// Parses a size like 64M, returns 0 if it isn't one
+static size_t parse_size(const char *arg)
 {
-	return update_crc(0L, buf, len);
-}
-// -------------------RFC1952 CRC code end----------------------
-
-
-
-// this function checks the zip magic and the comment length to see if 
-// the eocd structure has been located
-inline int validate_eocd(struct zip_eocd *eocd, uint32_t offset)
-{
-	return (eocd->magic == ZIP_EOCD_MAGIC) && ((offset-23) == eocd->comment_len);
-}
+	char *end;
+	unsigned long long n = strtoull(arg, &end, 10);
 
-// This function fills buffer with an ascii encoded octal string representing n
-void octal(int n, unsigned char *buffer, int len)
-{
-	int i = 0;
-	for (i = 0; i < len; i++, n = n >> 3)
-		buffer[len-1-i] = (n & 7) + '0';
-}
-
-// This is used to make sure that the end of each tar entry is aligned to 512 bytes
-static const unsigned char padding[512] = {0};
-
-void tar_set_checksum(struct tar_posix_header *header)
-{
-	uint32_t sum = 0;
-	int i;
-	unsigned char *header_data = (unsigned char *)header;
-	for (i=0; i<8; i++)
-		header->chksum[i] = ' ';
-
-	for (i=0;i<sizeof(struct tar_posix_header); i++)
-		sum += header_data[i];
-
-	octal(sum, header->chksum, 6);
-	header->chksum[6] = '\0';
-}
-
-inline uint32_t tar_entry_size(uint32_t file_size, uint8_t deflated)
-{
-	return file_size + (deflated ? (sizeof(struct gz_header) + sizeof(struct gz_footer)) : 0);
-}
-
-void tar_write(unsigned char *fname, int zip_fd, int tar_fd, struct zip_directory *dir_entry)
-{
-	int i;
-	struct zip_local_file file_entry;
-	unsigned char *buffer; // used for the compressed file data
-	struct tar_posix_header tar_header = {0};
-	struct gz_header header = {0};
-	struct gz_footer footer = {0};
-	buffer = malloc(dir_entry->zip_size);
-
-	// tar headers
-	if (dir_entry->fname_len < 98)
-		for (i=0; fname[i] != 0; i++)
-				tar_header.name[i] = fname[i];
-	else
-		for (i=0; fname[i] != 0; i++)
-			if (i < 155)
-				tar_header.prefix[i] = fname[i];
-			else
-				tar_header.name[i-155] = fname[i];
-
-	for (i=0; i < 7; i++)
-	{
-		tar_header.mode[i] = '0';
-		tar_header.gid[i] = '0';
-		tar_header.uid[i] = '0';
-		tar_header.mtime[i] = '0';
-	}
-	tar_header.typeflag = '0';
-
-	octal(tar_entry_size(dir_entry->zip_size, dir_entry->compression == ZIP_ALG_DEFLATE), tar_header.size, 11);
-
-	tar_header.magic[0] = 'u';
-	tar_header.magic[1] = 's';
-	tar_header.magic[2] = 't';
-	tar_header.magic[3] = 'a';
-	tar_header.magic[4] = 'r';
-	tar_header.magic[5] = ' ';
-	tar_header.magic[6] = ' ';
-//	tar_header.version[0] = '0';
-//	tar_header.version[1] = '0';
-
-	tar_set_checksum(&tar_header);
-
-	// gz headers
-	header.magic = GZ_MAGIC;
-	header.method = GZ_METHOD_DEFLATE;
-	header.flags = 0;
-	header.os = GZ_OS_LINUX;
-
-	footer.crc = dir_entry->crc32;
-	footer.isize = dir_entry->unzip_size;
-
-	// jump to the file and extract it
-	int pos = lseek(zip_fd, 0, SEEK_CUR);
-	lseek(zip_fd, dir_entry->offset, SEEK_SET);
-
-	read(zip_fd, &file_entry, 30);
-	lseek(zip_fd, file_entry.fname_len + file_entry.extra_len, SEEK_CUR);
-	read(zip_fd, buffer, dir_entry->zip_size);
-
-	write(tar_fd, &tar_header, sizeof(struct tar_posix_header));
-	if (dir_entry->compression == ZIP_ALG_DEFLATE)
-	{
-		write(tar_fd, &header, sizeof(struct gz_header));
-		write(tar_fd, buffer, dir_entry->zip_size);
-		write(tar_fd, &footer, sizeof(struct gz_footer));
-	}
-	else if (dir_entry->compression == ZIP_ALG_STORE)
+	switch (*end)
 	{
-		write(tar_fd, buffer, dir_entry->zip_size);
+		case 'G': case 'g':
+			n <<= 10;
+			// fall through
+		case 'M': case 'm':
+			n <<= 10;
+			// fall through
+		case 'K': case 'k':
+			n <<= 10;
+			end++;
+			break;
 	}
-	write(tar_fd, padding, 512 - ((sizeof(struct tar_posix_header) + tar_entry_size(dir_entry->zip_size, dir_entry->compression == ZIP_ALG_DEFLATE)) % 512));
-
-	free(buffer);
 
-	lseek(zip_fd, pos, SEEK_SET);
+	return *end || end == arg ? 0 : n;
 }
 
-void tgz_write(unsigned char *fname, int zip_fd, int tar_fd, struct zip_directory *dir_entry)
+// Reads zip and tar file pairs, one per line with a tab (or failing that, 
+// the last space) between them, into *items. Returns how many, or -1.
+static int batch_read_list(const char *path, struct bh_batch **items)
 {
-	int i;
-	struct zip_local_file file_entry;
-	unsigned char *buffer; // used for the compressed file data
-	struct deflate_store_header store_header = {0};
-	struct gz_header header = {0};
-	struct gz_footer footer = {0};
-	struct tar_posix_header tar_header = {0};
-	buffer = malloc(dir_entry->zip_size);
-
-	// tar headers
-	if (dir_entry->fname_len < 98)
-		for (i=0; fname[i] != 0; i++)
-				tar_header.name[i] = fname[i];
-	else
-		for (i=0; fname[i] != 0; i++)
-			if (i < 155)
-				tar_header.prefix[i] = fname[i];
-			else
-				tar_header.name[i-155] = fname[i];
-
-	for (i=0; i < 7; i++)
+	FILE *list;
+	char *line = NULL, *split;
+	size_t size = 0;
+	ssize_t len;
+	int count = 0, capacity = 0;
+	void *p;
+
+	list = (path[0] == '-' && path[1] == 0) ? stdin : fopen(path, "r");
+	if (!list)
+		return -1;
+
+	while ((len = getline(&line, &size, list)) != -1)
 	{
-		tar_header.mode[i] = '0';
-		tar_header.gid[i] = '0';
-		tar_header.uid[i] = '0';
-		tar_header.mtime[i] = '0';
-	}
-	tar_header.typeflag = '0';
-
-	octal(tar_entry_size(dir_entry->unzip_size, dir_entry->compression == ZIP_ALG_DEFLATE), tar_header.size, 11);
-
-	tar_header.magic[0] = 'u';
-	tar_header.magic[1] = 's';
-	tar_header.magic[2] = 't';
-	tar_header.magic[3] = 'a';
-	tar_header.magic[4] = 'r';
-	tar_header.magic[5] = ' ';
-	tar_header.magic[6] = ' ';
-//	tar_header.version[0] = '0';
-//	tar_header.version[1] = '0';
-
-	tar_set_checksum(&tar_header);
-
-	// gz headers
-	header.magic = GZ_MAGIC;
-	header.method = GZ_METHOD_DEFLATE;
-	header.flags = 0;
-	header.os = GZ_OS_LINUX;
-
-	footer.crc = update_crc(dir_entry->crc32, &tar_header, sizeof(struct tar_posix_header));
-	footer.isize = dir_entry->unzip_size + sizeof(struct tar_posix_header);
-	printf("Orig CRC: %x\n", dir_entry->crc32);
-	printf("New CRC: %x\n", footer.crc);
-
-	// jump to the file and extract it
-	int pos = lseek(zip_fd, 0, SEEK_CUR);
-	lseek(zip_fd, dir_entry->offset, SEEK_SET);
-
-	read(zip_fd, &file_entry, 30);
-	lseek(zip_fd, file_entry.fname_len + file_entry.extra_len, SEEK_CUR);
-	read(zip_fd, buffer, dir_entry->zip_size);
-
-	write(tar_fd, &header, sizeof(struct gz_header));
-
-	store_header.block_size = sizeof(struct tar_posix_header);
-	store_header.inverse_size = ~store_header.block_size;
-	write(tar_fd, &store_header, sizeof(struct deflate_store_header));
-
-	write(tar_fd, &tar_header, sizeof(struct tar_posix_header));
-	if (dir_entry->compression == ZIP_ALG_STORE)
-	{
-		// need to make this into gzip format...
-	}
-	write(tar_fd, buffer, dir_entry->zip_size);
-	write(tar_fd, &footer, sizeof(struct gz_footer));
-
-	uint16_t pad_bytes = 512 - ((sizeof(struct tar_posix_header) + tar_entry_size(dir_entry->unzip_size, 0)) % 512);
-	if (pad_bytes) // only create this if the tar entry needs padding
-	{
-		write(tar_fd, &header, sizeof(struct gz_header));
-		store_header.method = 4; // mark as a final block
-		store_header.block_size = pad_bytes;
-		store_header.inverse_size = ~store_header.block_size;
-		write(tar_fd, &store_header, sizeof(struct deflate_store_header));
-
-		write(tar_fd, padding, pad_bytes);
-
-		footer.crc = update_crc(0, padding, pad_bytes);
-		footer.isize = pad_bytes;
-		write(tar_fd, &footer, sizeof(struct gz_footer));
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+		split = strchr(line, '\t');
+		if (!split)
+			split = strrchr(line, ' ');
+		if (!split || split == line || !split[1])
+			continue;
+		*split = 0;
+
+		if (count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			p = realloc(*items, sizeof(struct bh_batch) * capacity);
+			if (!p)
+				break;
+			*items = p;
+		}
+		(*items)[count].zip_path = strdup(line);
+		(*items)[count].tar_path = strdup(split + 1);
+		if (!(*items)[count].zip_path || !(*items)[count].tar_path)
+			break;
+		count++;
 	}
 
-	free(buffer);
-
-	lseek(zip_fd, pos, SEEK_SET);
-}
-
-void gz_create(unsigned char *fname, int zip_fd, struct zip_directory *dir_entry)
-{
-	struct zip_local_file file_entry;
-	unsigned char *buffer; // used for the compressed file data
-	struct gz_header header = {0};
-	struct gz_footer footer = {0};
-	int gz_fd = open(fname, O_WRONLY | O_CREAT, 0);
-	buffer = malloc(dir_entry->zip_size);
-
-	header.magic = GZ_MAGIC;
-	header.method = GZ_METHOD_DEFLATE;
-	header.flags = 0;
-	header.os = GZ_OS_LINUX;
-
-	footer.crc = dir_entry->crc32;
-	footer.isize = dir_entry->unzip_size;
-
-	// jump to the file and extract it
-	int pos = lseek(zip_fd, 0, SEEK_CUR);
-	lseek(zip_fd, dir_entry->offset, SEEK_SET);
-
-	read(zip_fd, &file_entry, 30);
-	lseek(zip_fd, file_entry.fname_len + file_entry.extra_len, SEEK_CUR);
-	read(zip_fd, buffer, dir_entry->zip_size);
-
-	write(gz_fd, &header, sizeof(struct gz_header));
-
-	write(gz_fd, buffer, dir_entry->zip_size);
+	free(line);
+	if (list != stdin)
+		fclose(list);
 
-	write(gz_fd, &footer, 8);
-
-	close(gz_fd);
-	free(buffer);
-
-	lseek(zip_fd, pos, SEEK_SET);
-}
-
-int zip_locate_eocd(int zip_fd, struct zip_eocd *zip_footer)
-{
-	uint32_t offset = 22;
-	lseek(zip_fd, -(int)offset, SEEK_END);
-
-	// Locate the End of Central Directory header (located at the end of the file)
-	while (!validate_eocd(zip_footer, offset))
-	{
-		read(zip_fd, zip_footer, 22);
-		if (lseek(zip_fd, -23, SEEK_CUR) == -1)
-			return -1;
-		offset += 1;
-	}
-
-	return offset;
+	return len == -1 ? count : -1;
 }
 
 int main(int argc, char **argv)
 {
-	int i, j;
-	unsigned char *inname[2];
-	int fd[2];
-	uint32_t offset = 0;
-	unsigned char fname[512];
-	unsigned char *zip_fname, *tar_fname;
+	int i, j, ret;
+	char **inname;
+	struct bh_batch *batch = NULL;
+	int batch_count = 0;
+	char *batch_list = NULL;
+	int use_batch = 0;
+	size_t max_memory = 0;
+	int compress = 0;
+	int dedup = 0;
+	char *base_path = NULL;
+	int order = BH_ORDER_DIRECTORY;
+	struct stat tar_stat, base_stat;
+	struct bh_archive *archive = NULL;
+	struct bh_filter *filter = NULL;
+	struct bh_sink *sink = NULL;
+	int zip_fd = -1;
+	int tar_fd = -1;
+	int use_map = 0;
+	int use_stream = 0;
+	int use_uring = 0;
+	int use_index = 0;
+	int index_fd = -1;
+	int jobs = 1;
+	int verify = 0;
+	int stats = BH_STATS_OFF;
+	char *lookup_name = NULL;
+	char *arg, opt;
+	char index_path[4096];
 	uint8_t method = BH_MODE_MAKE_TAR;
 
+	bh_echo(STDOUT_FILENO);
+	bh_messages(stderr);
+
+	// names in batch mode can be any number of pairs
+	inname = malloc(sizeof(char *) * argc);
+	if (!inname)
+		exit(1);
+
 	for (i=1, j=0; i < argc; i++)
 	{
-		if (argv[i][0] == '-')
+		if (argv[i][0] == '-' && argv[i][1] != 0) // a lone - is stdin or stdout
 		{
 			switch (argv[i][1])
 			{
 				case BH_MODE_MAKE_TAR: // create tarball
 				case BH_MODE_MAKE_TGZ: // create tar.gz
+				case BH_MODE_MAKE_TGZ_SINGLE:
 				case BH_MODE_EXTRACT:  // Extract to gz
+				case BH_MODE_MAKE_ZIP: // tarball to zip
 					method = argv[i][1];
 					break;
+				case BH_OPT_MMAP:
+					use_map = 1;
+					break;
+				case BH_OPT_STREAM:
+					use_stream = 1;
+					break;
+				case BH_OPT_URING:
+					use_uring = 1;
+					break;
+				case BH_OPT_INDEX:
+					use_index = 1;
+					break;
+				case BH_OPT_INCLUDE:
+				case BH_OPT_EXCLUDE:
+				case BH_OPT_LIST:
+					opt = argv[i][1];
+					arg = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : NULL);
+					if (!arg)
+						break;
+					if (!filter && bh_filter_new(&filter) != BH_OK)
+						exit(1);
+					if (opt == BH_OPT_INCLUDE)
+						ret = bh_filter_include(filter, arg);
+					else if (opt == BH_OPT_EXCLUDE)
+						ret = bh_filter_exclude(filter, arg);
+					else if ((ret = bh_filter_list(filter, arg)) == BH_ERR_IO)
+					{
+						printf("Could not read the list of names in %s.\n", arg);
+						exit(1);
+					}
+					if (ret != BH_OK)
+						exit(1);
+					break;
+				case BH_MODE_LOOKUP:
+					method = argv[i][1];
+					if (argv[i][2])
+						lookup_name = argv[i] + 2;
+					else if (i + 1 < argc)
+						lookup_name = argv[++i];
+					break;
+				case '-': // long options
+					if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0)
+						stats = BH_STATS_TEXT;
+					else if (strcmp(argv[i], "--stats=json") == 0)
+						stats = BH_STATS_JSON;
+					else if (strcmp(argv[i], "--verify") == 0)
+						verify = BH_VERIFY_STORED;
+					else if (strcmp(argv[i], "--verify=inflate") == 0)
+						verify = BH_VERIFY_INFLATE;
+					else if (strncmp(argv[i], "--max-memory=", 13) == 0 && !(max_memory = parse_size(argv[i] + 13)))
+					{
+						printf("%s is not a size.\n", argv[i] + 13);
+						exit(1);
+					}
+					else if (strcmp(argv[i], "--compress") == 0)
+						compress = 6;
+					else if (strncmp(argv[i], "--compress=", 11) == 0)
+						compress = atoi(argv[i] + 11);
+					else if (strcmp(argv[i], "--dedup") == 0)
+						dedup = 1;
+					else if (strncmp(argv[i], "--from=", 7) == 0)
+						base_path = argv[i] + 7;
+					else if (strcmp(argv[i], "--physical") == 0)
+						order = BH_ORDER_PHYSICAL;
+					else if (strcmp(argv[i], "--physical=read") == 0)
+						order = BH_ORDER_READ;
+					else if (strcmp(argv[i], "--batch") == 0)
+						use_batch = 1;
+					else if (strncmp(argv[i], "--batch=", 8) == 0)
+					{
+						use_batch = 1;
+						batch_list = argv[i] + 8;
+					}
+					break;
+				case BH_OPT_JOBS:
+					if (argv[i][2])
+						jobs = atoi(argv[i] + 2);
+					else if (i + 1 < argc)
+						jobs = atoi(argv[++i]);
+					if (jobs <= 0)
+						jobs = sysconf(_SC_NPROCESSORS_ONLN);
+					break;
 				default:
 					break;
 			}
 		}
 		else
 		{
-			if (j < 2)
+			inname[j] = argv[i];
+			j++;
+		}
+	}
+	if (j > 2 && !use_batch)
+		j = 2;
+
+	if (stats)
+	{
+		bh_stats(stats);
+		atexit(bh_stats_report);
+	}
+	if (max_memory)
+		bh_max_memory(max_memory / jobs);
+
+	// entries going out on -j threads of their own are compressed on one 
+	// each, otherwise every cpu works on one entry at a time
+	if (compress && (method == BH_MODE_MAKE_TGZ || method == BH_MODE_MAKE_TGZ_SINGLE || method == BH_MODE_EXTRACT))
+	{
+		if (bh_compress(compress, jobs > 1 && (method == BH_MODE_EXTRACT || use_batch) ? 1 : jobs > 1 ? jobs : sysconf(_SC_NPROCESSORS_ONLN)) != BH_OK)
+		{
+			printf("--compress needs a level from 1 to 9, and baghand built with zlib.\n");
+			exit(1);
+		}
+		if (use_index)
+		{
+			printf("An index can't be made of a tar file with --compress.\n");
+			exit(1);
+		}
+	}
+
+	// every zip gets a line saying how it went instead of its entry names
+	if (use_batch)
+	{
+		if ((method != BH_MODE_MAKE_TAR && method != BH_MODE_MAKE_TGZ && method != BH_MODE_MAKE_TGZ_SINGLE) || use_stream || use_index || verify || dedup || base_path || order != BH_ORDER_DIRECTORY)
+		{
+			printf("--batch only makes tarballs (-c, -z or -Z), without -s, -i, --verify, --dedup, --from or --physical.\n");
+			exit(1);
+		}
+		if (batch_list && (batch_count = batch_read_list(batch_list, &batch)) == -1)
+		{
+			printf("Could not read the list of zip files in %s.\n", batch_list);
+			exit(1);
+		}
+		if (!batch_list && j % 2 == 0)
+		{
+			batch = malloc(sizeof(struct bh_batch) * (j / 2 + 1));
+			if (!batch)
+				exit(1);
+			for (batch_count = 0; batch_count < j / 2; batch_count++)
 			{
-				inname[j] = argv[i];
-				j++;
+				batch[batch_count].zip_path = inname[batch_count * 2];
+				batch[batch_count].tar_path = inname[batch_count * 2 + 1];
 			}
 		}
+		if (batch_count == 0)
+		{
+			printf("A zip file and a tar file for each conversion are required.\n");
+			usage();
+			exit(1);
+		}
+		for (i = 0; i < batch_count; i++)
+			batch[i].flags = use_map ? BH_OPEN_MMAP : 0;
+
+		bh_echo(-1);
+		ret = bh_batch(batch, batch_count, method, filter, jobs);
+		for (i = 0; i < batch_count; i++)
+			printf("%s: %s\n", batch[i].zip_path, batch[i].status == BH_OK ? "ok" : bh_strerror(batch[i].status));
+		exit(ret == BH_OK ? 0 : 1);
+	}
+
+	// the only file named is the tarball
+	if (method == BH_MODE_LOOKUP)
+	{
+		if (!lookup_name || j < 1)
+		{
+			printf("A name and a tar file are required.\n");
+			usage();
+			exit(1);
+		}
+		ret = bh_lookup(inname[0], lookup_name, use_map ? BH_OPEN_MMAP : 0, STDOUT_FILENO);
+		exit(ret == BH_OK ? 0 : 1);
 	}
 
-	fd[0] = open(inname[0], O_RDONLY, 0);
-	if (fd[0] == -1)
+	if (method == BH_MODE_MAKE_ZIP)
+	{
+		// here the tar file is read and the zip file written. The zip is 
+		// truncated, since a stale tail would leave the old end of central 
+		// directory at the end of the file.
+		if (j >= 2 && inname[1][0] == '-' && inname[1][1] == 0)
+			tar_fd = STDIN_FILENO;
+		else
+			tar_fd = j < 2 ? -1 : open(inname[1], O_RDONLY, 0);
+		if (j >= 1 && inname[0][0] == '-' && inname[0][1] == 0)
+		{
+			zip_fd = STDOUT_FILENO;
+			bh_echo(STDERR_FILENO);
+		}
+		else
+			zip_fd = j < 1 ? -1 : open(inname[0], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (tar_fd == -1 || zip_fd == -1)
+		{
+			printf("A tar file to read and a zip file to write are required.\n");
+			usage();
+			exit(1);
+		}
+
+		ret = bh_reverse(tar_fd, zip_fd);
+		if (ret != BH_OK)
+			printf("Could not save zip file.\n");
+		close(zip_fd);
+		exit(ret == BH_OK ? 0 : 1);
+	}
+
+	// a zip file of - is read from stdin, which can only be streamed
+	if (j >= 1 && inname[0][0] == '-' && inname[0][1] == 0)
+		use_stream = 1;
+
+	ret = BH_ERR_IO;
+	if (j >= 1 && use_stream)
+		zip_fd = inname[0][0] == '-' && inname[0][1] == 0 ? STDIN_FILENO : open(inname[0], O_RDONLY, 0);
+	else if (j >= 1)
+		ret = bh_open(&archive, inname[0], use_map ? BH_OPEN_MMAP : 0);
+	if (zip_fd == -1 && ret == BH_ERR_IO)
 	{
 		printf("A zip file is required.\n");
 		usage();
@@ -521,15 +404,58 @@ int main(int argc, char **argv)
 	{
 		case BH_MODE_MAKE_TAR:
 		case BH_MODE_MAKE_TGZ:
-			fd[1] = open(inname[1], O_WRONLY | O_CREAT, 0);
-			if (fd[1] == -1)
+		case BH_MODE_MAKE_TGZ_SINGLE:
+			// --verify without a tar file only checks the zip
+			if (j < 2 && verify)
+				break;
+			if (j >= 2 && inname[1][0] == '-' && inname[1][1] == 0)
+			{
+				tar_fd = STDOUT_FILENO;
+				bh_echo(STDERR_FILENO);
+			}
+			else
+			{
+				// the old tarball is read while the new one is written, 
+				// and opening that truncates it
+				if (j >= 2 && base_path && stat(base_path, &base_stat) == 0 && stat(inname[1], &tar_stat) == 0 &&
+					base_stat.st_dev == tar_stat.st_dev && base_stat.st_ino == tar_stat.st_ino)
+				{
+					printf("--from needs the new tar file to be a different one.\n");
+					exit(1);
+				}
+				tar_fd = j < 2 ? -1 : open(inname[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			}
+			if (tar_fd == -1)
 			{
 				printf("Could not save tar file.\n");
 				usage();
 				exit(1);
 			}
+
+			// entries are laid out from the central directory, which -s 
+			// doesn't have until the end
+			if (use_index)
+			{
+				if (tar_fd == STDOUT_FILENO || use_stream || method == BH_MODE_MAKE_TGZ_SINGLE)
+				{
+					printf("An index needs a tar file, and can't be made with -s or -Z.\n");
+					exit(1);
+				}
+				if (snprintf(index_path, sizeof(index_path), "%s.idx", inname[1]) < (int)sizeof(index_path))
+					index_fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				if (index_fd == -1)
+				{
+					printf("Could not save the index.\n");
+					exit(1);
+				}
+			}
 			break;
 		case BH_MODE_EXTRACT:
+			if (base_path)
+			{
+				printf("--from only works when making a tar file.\n");
+				exit(1);
+			}
 			break;
 		default:
 			write(1, "You are not argumentative enough to use this program.\n", 54);
@@ -538,69 +464,92 @@ int main(int argc, char **argv)
 			break;
 	}
 
-	struct zip_directory zip_dir = {0};
-	struct zip_eocd zip_footer = {0};
+	if (use_stream && verify)
+	{
+		printf("--verify reads the zip file twice, it can't be used with -s.\n");
+		exit(1);
+	}
+	if (use_stream && (dedup || base_path))
+	{
+		printf("--dedup and --from need the central directory first, they can't be used with -s.\n");
+		exit(1);
+	}
+	if (use_stream)
+	{
+		ret = bh_convert_stream(zip_fd, method, tar_fd, filter);
+		if (ret == BH_ERR_MEMORY)
+			printf("Out of memory.\n");
+		exit(ret == BH_OK ? 0 : 1);
+	}
 
-	// Locate the End of Central Directory header (located at the end of the file)
-	offset = zip_locate_eocd(fd[0], &zip_footer);
-	if (offset == -1)
+	if (ret == BH_ERR_NOT_ZIP)
 	{
 		printf("This does not appear to be a zip file.\n");
 		usage();
 		exit(1);
 	}
+	if (ret != BH_OK)
+	{
+		printf("The central directory of this zip file is damaged.\n");
+		exit(1);
+	}
 
-	// Jump to the beginning of the Central Directories
-	lseek(fd[0], zip_footer.central_dir_offset, SEEK_SET);
+	if (filter && bh_select(archive, filter) != BH_OK)
+	{
+		printf("Out of memory.\n");
+		exit(1);
+	}
+	bh_filter_free(filter);
 
-	// Iterate through all the Central Directories
-	for (i = 0; i < zip_footer.total_central_records; i++)
+	// (-s has already gone through the zip front to back, above)
+	if (order != BH_ORDER_DIRECTORY && bh_order(archive, order) != BH_OK)
 	{
-		read(fd[0], &zip_dir, 46);
-		if (zip_dir.magic == ZIP_CD_MAGIC) // Just for sanity
-		{
-			read(fd[0], &fname, zip_dir.fname_len);
+		printf("Out of memory.\n");
+		exit(1);
+	}
 
-			write(1, fname, zip_dir.fname_len);
-			if (zip_dir.compression == ZIP_ALG_DEFLATE && method != BH_MODE_MAKE_TGZ)
-			{
-				fname[zip_dir.fname_len+0] = '.';
-				fname[zip_dir.fname_len+1] = 'g';
-				fname[zip_dir.fname_len+2] = 'z';
-				fname[zip_dir.fname_len+3] = 0;
-				write(1, ".gz\n", 4);
-			}
-			else if (zip_dir.compression == ZIP_ALG_STORE || method == BH_MODE_MAKE_TGZ)
-			{
-				fname[zip_dir.fname_len] = 0;
-				write(1, "\n", 1);
-			}
+	if (dedup && bh_dedup(archive) != BH_OK)
+	{
+		printf("Could not read the zip file to compare its entries.\n");
+		exit(1);
+	}
+	if (base_path && bh_base(archive, base_path, use_map ? BH_OPEN_MMAP : 0, NULL) != BH_OK)
+	{
+		printf("Could not use %s and its index.\n", base_path);
+		exit(1);
+	}
 
-			switch (method)
-			{
-				case BH_MODE_MAKE_TAR:
-					tar_write(fname, fd[0], fd[1], &zip_dir);
-					break;
-				case BH_MODE_EXTRACT:
-					gz_create(fname, fd[0], &zip_dir);
-					break;
-				case BH_MODE_MAKE_TGZ:
-					tgz_write(fname, fd[0], fd[1], &zip_dir);
-					break;
-				default:
-					usage();
-					exit(1);
-					break;
-			}
-			// return to previous position
-//			lseek(fd[0], pos, SEEK_SET);
-			// -------------------------------
+	// the checks run alongside whatever the conversion does below
+	if (verify && bh_verify_start(archive, verify, jobs > 1 ? jobs : 0) != BH_OK)
+	{
+		printf("Out of memory.\n");
+		exit(1);
+	}
+
+	if (method == BH_MODE_EXTRACT)
+		ret = bh_extract(archive, jobs, use_uring ? BH_EXTRACT_URING : 0);
+	else if (tar_fd != -1)
+	{
+		if (bh_sink_fd(&sink, tar_fd) != BH_OK)
+		{
+			printf("Out of memory.\n");
+			exit(1);
+		}
+		ret = bh_convert(archive, method, sink, jobs);
+		if (ret != BH_OK)
+			printf("Could not save tar file.\n");
+		else if (index_fd != -1 && (bh_write_index(archive, method, index_fd) != BH_OK || close(index_fd) == -1))
+		{
+			printf("Could not save the index.\n");
+			ret = BH_ERR_IO;
 		}
-		lseek(fd[0], zip_dir.extra_len + zip_dir.comment_len, SEEK_CUR);
+		bh_sink_free(sink);
+		close(tar_fd);
 	}
-	close(fd[0]);
-	close(fd[1]);
 
-	exit(0);
-}
+	if (bh_verify_finish(archive) != BH_OK)
+		ret = BH_ERR_DAMAGED;
+	bh_close(archive);
 
+	exit(ret == BH_OK ? 0 : 1);
+}
@@ -0,0 +1,216 @@
+// libbaghand - converts zip files to tarballs of gzipped files, gzipped
+// tarballs or gzip files (and back) without decompressing anything. This
+// is everything the baghand command does, for programs that would rather
+// not run it for every zip.
+//
+// A zip is opened into a struct bh_archive, which has its central directory
+// loaded, and can then be walked with bh_next() and converted whole or an
+// entry at a time into a sink: a file descriptor, a buffer in memory or a
+// callback of your own. Nothing prints or exits, every function that can
+// fail returns BH_OK or one of the BH_ERR_ codes below. An archive is used
+// by one thread at a time, but any number of archives can be converted at
+// once on different threads. The settings at the end of this file are the
+// exception: they're shared by the whole process, so set them up before 
+// starting any threads.
+
+#ifndef BAGHAND_H
+#define BAGHAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BH_OK            0
+#define BH_ERR_IO       -1 // reading or writing failed
+#define BH_ERR_MEMORY   -2
+#define BH_ERR_NOT_ZIP  -3 // no end of central directory, or not a tarball for bh_reverse()
+#define BH_ERR_DAMAGED  -4 // the central directory, an entry or a crc doesn't add up
+#define BH_ERR_ARGUMENT -5 // a mode or sink that can't be used for this
+#define BH_ERR_NAME     -6 // a name too long for a tar header, or not in the index
+
+// What to convert to
+#define BH_MODE_MAKE_TAR 'c' // a tarball of gzipped files
+#define BH_MODE_MAKE_TGZ 'z' // a gzipped tarball
+#define BH_MODE_MAKE_TGZ_SINGLE 'Z' // the same as a single gzip member, see bh_convert()
+#define BH_MODE_EXTRACT  'x' // gzip files, or the data itself for stored entries
+
+// flags for bh_open() and bh_lookup()
+#define BH_OPEN_MMAP 1 // map the whole zip into memory instead of reading it
+
+// flags for bh_extract()
+#define BH_EXTRACT_URING 1 // through io_uring, if it was built in and the kernel has it
+
+// orders for bh_order()
+#define BH_ORDER_DIRECTORY 0 // the central directory's
+#define BH_ORDER_PHYSICAL  1 // where the entries are in the zip, for reading and output
+#define BH_ORDER_READ      2 // read in the zip's order, output in the directory's
+
+// levels for bh_verify_start()
+#define BH_VERIFY_STORED  1 // crc the stored entries
+#define BH_VERIFY_INFLATE 2 // and inflate the deflated ones
+
+// modes for bh_stats()
+#define BH_STATS_OFF  0
+#define BH_STATS_TEXT 1
+#define BH_STATS_JSON 2
+
+struct bh_archive;
+struct bh_sink;
+struct bh_filter;
+
+// One central directory record. name points into the archive and is only
+// good until it's closed; it is NUL terminated.
+struct bh_entry
+{
+	uint32_t index; // in the central directory, after bh_select()
+	const char *name;
+	uint16_t name_len;
+	uint16_t compression; // 0 stored, 8 deflated
+	uint32_t crc32;
+	uint32_t dos_time; // MS-DOS date << 16 | time
+	uint64_t zip_size;
+	uint64_t unzip_size;
+	uint64_t offset; // of the local file header
+};
+
+const char *bh_strerror(int error);
+
+// Opens the zip at path and loads its central directory
+int bh_open(struct bh_archive **archive, const char *path, int flags);
+void bh_close(struct bh_archive *archive);
+
+uint32_t bh_count(struct bh_archive *archive);
+int bh_entry(struct bh_archive *archive, uint32_t index, struct bh_entry *entry);
+
+// Walks the entries: start with *cursor = 0, and it returns 1 and the next
+// entry until there are none left, then 0.
+int bh_next(struct bh_archive *archive, uint32_t *cursor, struct bh_entry *entry);
+
+// Globs (fnmatch(), * matches /) and lists of names to convert only some of
+// the entries. An entry is kept if it matches an include glob or is on a
+// list (or there are neither), and doesn't match an exclude glob.
+int bh_filter_new(struct bh_filter **filter);
+int bh_filter_include(struct bh_filter *filter, const char *glob);
+int bh_filter_exclude(struct bh_filter *filter, const char *glob);
+int bh_filter_list(struct bh_filter *filter, const char *path); // one name per line, - for stdin
+void bh_filter_free(struct bh_filter *filter);
+
+// Drops the entries of archive that filter doesn't keep
+int bh_select(struct bh_archive *archive, struct bh_filter *filter);
+
+// Where output goes. A memory sink keeps it all, see bh_sink_data(). A
+// callback sink hands it to write(), which returns 0, or -1 to give up.
+// Only an fd sink can be written by the kernel without the data passing
+// through memory, so it's the fastest by far.
+int bh_sink_fd(struct bh_sink **sink, int fd);
+int bh_sink_memory(struct bh_sink **sink);
+int bh_sink_callback(struct bh_sink **sink, int (*write)(void *ctx, const void *buf, size_t len), void *ctx);
+const void *bh_sink_data(struct bh_sink *sink, size_t *len);
+void bh_sink_free(struct bh_sink *sink);
+
+// Sets the order the entries of archive are read in, see BH_ORDER_ above.
+// Going through the zip front to back turns a directory that jumps about 
+// into sequential reads, and entries lying next to each other are read 
+// ahead together. BH_ORDER_PHYSICAL puts the entries themselves in that 
+// order, so bh_next(), the tarball and its index all follow it, and 
+// bh_dedup() and bh_base() have to come after it. BH_ORDER_READ leaves them
+// in directory order: a plain tarball going to an fd sink on a regular file
+// is written in place (see bh_convert()), and extracted files don't have an
+// order, but a gzipped tarball is still read in directory order.
+int bh_order(struct bh_archive *archive, int order);
+
+// Finds the entries of archive with the same data as an earlier one, 
+// comparing them byte for byte, so that they're written as hard links to it
+// by bh_convert() and bh_extract(). bh_select() forgets them, so it has to
+// come first.
+int bh_dedup(struct bh_archive *archive);
+
+// Copies the data of the entries that haven't changed since the tarball at
+// tar_path was made (with bh_write_index()) out of it, instead of the zip, 
+// when archive is converted into a tarball. The copy is done by the kernel,
+// and can share the blocks of tar_path on a filesystem that does that. 
+// reused, if it isn't NULL, gets how many entries are copied that way. 
+// bh_select() forgets this too.
+int bh_base(struct bh_archive *archive, const char *tar_path, int flags, uint32_t *reused);
+
+// Converts every entry of archive into a BH_MODE_MAKE_TAR or
+// BH_MODE_MAKE_TGZ tarball. A plain tarball going to an fd sink on a
+// regular file is written by jobs threads.
+// BH_MODE_MAKE_TGZ makes a gzip member of every entry, which is quickest
+// but trips up tools that stop after the first member.
+// BH_MODE_MAKE_TGZ_SINGLE joins the deflate streams up into one member 
+// instead. Each one has to be decoded (not inflated) to find its last 
+// block, and it can't be made into a zip again by bh_reverse() or indexed.
+int bh_convert(struct bh_archive *archive, int mode, struct bh_sink *sink, int jobs);
+
+// One zip to convert in a batch, into the tarball at tar_path. status is 
+// filled in with BH_OK or what went wrong with this one.
+struct bh_batch
+{
+	const char *zip_path;
+	const char *tar_path;
+	int flags; // for bh_open()
+	int status;
+};
+
+// Converts count zips into BH_MODE_MAKE_TAR or BH_MODE_MAKE_TGZ tarballs on
+// jobs threads, each taking whole zips and reusing its buffers from one to
+// the next. A zip that fails doesn't stop the others. Returns BH_OK, or the 
+// status of the first one that failed. filter can be NULL.
+int bh_batch(struct bh_batch *items, uint32_t count, int mode, struct bh_filter *filter, int jobs);
+
+// Converts one entry: a tar member (BH_MODE_MAKE_TAR, without the two zero
+// blocks that end a tarball) or its gzip file (BH_MODE_EXTRACT)
+int bh_convert_entry(struct bh_archive *archive, const struct bh_entry *entry, int mode, struct bh_sink *sink);
+
+// Writes every entry to a gzip file of its own (stored ones as they are) in
+// the current directory, on jobs threads
+int bh_extract(struct bh_archive *archive, int jobs, int flags);
+
+// Converts a zip arriving on zip_fd front to back, without seeking, into
+// tar_fd (in the current directory for BH_MODE_EXTRACT). filter can be NULL.
+int bh_convert_stream(int zip_fd, int mode, int tar_fd, struct bh_filter *filter);
+
+// Turns a tarball (or a gzipped one made by BH_MODE_MAKE_TGZ) on tar_fd
+// back into a zip on zip_fd. Both are read and written front to back. A 
+// hard link (from bh_dedup()) gets a copy of its target's data, which is
+// read again from tar_fd, so that needs tar_fd to be a file.
+int bh_reverse(int tar_fd, int zip_fd);
+
+// Writes the index of the tarball that bh_convert() makes of archive, for
+// bh_lookup(). It goes next to the tarball, as <tar file>.idx.
+int bh_write_index(struct bh_archive *archive, int mode, int fd);
+
+// Writes entry name of the tarball at tar_path to out_fd, found through
+// its index
+int bh_lookup(const char *tar_path, const char *name, int flags, int out_fd);
+
+// Checks the entries of archive against their crcs and sizes on threads
+// threads of its own, while the archive is converted. bh_verify_finish()
+// waits for them and returns BH_ERR_DAMAGED if any entry is.
+int bh_verify_start(struct bh_archive *archive, int level, int threads);
+int bh_verify_finish(struct bh_archive *archive);
+
+// The names of entries as they're converted are written to fd, one per
+// line, and what went wrong with which entry to messages. Both are off
+// (-1 and NULL) to begin with. They're shared by the whole process.
+void bh_echo(int fd);
+void bh_messages(FILE *file);
+
+// Deflates stored entries at level (1 to 9, 0 to leave them stored) on 
+// threads threads while making a BH_MODE_MAKE_TGZ tarball or extracting,
+// which bh_write_index() can't be used with. Returns BH_ERR_ARGUMENT if 
+// the library was built without zlib. Shared by the whole process.
+int bh_compress(int level, int threads);
+
+// Caps the memory a copy that has to go through user space uses, per thread
+// (0 for the default of 4 MB). Big entries of a mapped zip are also written
+// out and dropped from memory this much at a time. Shared by the whole
+// process.
+void bh_max_memory(size_t bytes);
+
+// Counts syscalls, bytes and time for the whole process, see bh_stats_report()
+void bh_stats(int mode);
+void bh_stats_report(void);
+
+#endif
@@ -0,0 +1,252 @@
+// bench - times baghand over a set of zips and prints one JSON object per
+// line and run, so results can be diffed and plotted between builds.
+//
+//	bench <baghand> <scratch dir> <runs> <zip file>...
+//
+// Every zip is converted with -c, -z and -x. Each mode runs <runs> times and
+// the fastest run is reported, then it runs once more under ptrace to count
+// the system calls it makes. The count is -1 when ptrace isn't allowed.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+
+struct bench_run
+{
+	double wall;
+	double user;
+	double sys;
+	uint64_t entries;
+	long syscalls;
+};
+
+static const char *modes[] = {"-c", "-z", "-x"};
+
+static double timeval_seconds(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Runs rm -rf on path, the scratch output of a previous run
+static void remove_path(const char *path)
+{
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		execlp("rm", "rm", "-rf", path, (char *)NULL);
+		_exit(127);
+	}
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+}
+
+// Counts the system calls of a child that stopped itself with
+// PTRACE_TRACEME, its threads included. Every call stops twice.
+static long trace_count(pid_t child)
+{
+	long stops = 0;
+	int status, sig;
+	pid_t pid;
+
+	if (waitpid(child, &status, 0) == -1 || !WIFSTOPPED(status))
+		return -1;
+	if (ptrace(PTRACE_SETOPTIONS, child, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL) == -1)
+		return -1;
+	ptrace(PTRACE_SYSCALL, child, 0, 0);
+
+	while ((pid = waitpid(-1, &status, __WALL)) > 0)
+	{
+		if (!WIFSTOPPED(status))
+			continue;
+
+		sig = 0;
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+			stops++;
+		else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP)
+			sig = WSTOPSIG(status);
+		ptrace(PTRACE_SYSCALL, pid, 0, sig);
+	}
+
+	return stops / 2;
+}
+
+// Runs baghand once. baghand prints a line per entry, which is how the
+// entries get counted.
+static int bench_one(const char *baghand, const char *mode, const char *zip, const char *out, int trace, struct bench_run *run)
+{
+	struct timespec start, end;
+	struct rusage usage;
+	char buffer[65536];
+	int pipe_fd[2], status;
+	ssize_t n, i;
+	pid_t pid;
+
+	memset(run, 0, sizeof(struct bench_run));
+	run->syscalls = -1;
+	remove_path(out);
+	if (strcmp(mode, "-x") == 0 && mkdir(out, 0755) == -1)
+		return -1;
+	if (pipe(pipe_fd) == -1)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid == -1)
+		return -1;
+	if (pid == 0)
+	{
+		dup2(pipe_fd[1], 1);
+		close(pipe_fd[0]);
+		close(pipe_fd[1]);
+		if (strcmp(mode, "-x") == 0 && chdir(out) == -1)
+			_exit(127);
+		if (trace)
+		{
+			if (ptrace(PTRACE_TRACEME, 0, 0, 0) == -1)
+				_exit(126);
+			raise(SIGSTOP);
+		}
+		if (strcmp(mode, "-x") == 0)
+			execl(baghand, baghand, mode, zip, (char *)NULL);
+		else
+			execl(baghand, baghand, mode, zip, out, (char *)NULL);
+		_exit(127);
+	}
+	close(pipe_fd[1]);
+
+	if (!trace)
+	{
+		while ((n = read(pipe_fd[0], buffer, sizeof(buffer))) > 0)
+			for (i = 0; i < n; i++)
+				run->entries += buffer[i] == '\n';
+		close(pipe_fd[0]);
+		if (wait4(pid, &status, 0, &usage) == -1)
+			return -1;
+	}
+	else
+	{
+		// a pipe buffer doesn't hold the names of a big zip, drain it in
+		// a child of our own so that the tracee never blocks for long
+		pid_t drain = fork();
+
+		if (drain == 0)
+		{
+			while (read(pipe_fd[0], buffer, sizeof(buffer)) > 0)
+				;
+			_exit(0);
+		}
+		close(pipe_fd[0]);
+		run->syscalls = trace_count(pid);
+		if (run->syscalls == -1)
+			kill(pid, SIGKILL);
+		wait4(pid, &status, 0, &usage);
+		waitpid(drain, NULL, 0);
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		fprintf(stderr, "bench: %s %s %s failed\n", baghand, mode, zip);
+		return -1;
+	}
+
+	run->wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	run->user = timeval_seconds(&usage.ru_utime);
+	run->sys = timeval_seconds(&usage.ru_stime);
+	return 0;
+}
+
+// A JSON string of a path, which might have quotes or backslashes in it
+static void print_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+		if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_run run, best;
+	struct stat zip_stat;
+	char out[4096], *baghand, *zip;
+	const char *name;
+	int runs, z, m, r;
+
+	if (argc < 5)
+	{
+		fprintf(stderr, "usage: bench <baghand> <scratch dir> <runs> <zip file>...\n");
+		return 1;
+	}
+	runs = atoi(argv[3]);
+	if (runs < 1)
+		runs = 1;
+	mkdir(argv[2], 0755);
+	baghand = realpath(argv[1], NULL);
+	if (!baghand)
+	{
+		fprintf(stderr, "bench: can't find %s\n", argv[1]);
+		return 1;
+	}
+
+	for (z = 4; z < argc; z++)
+	{
+		// -x runs inside the scratch dir
+		zip = realpath(argv[z], NULL);
+		if (!zip || stat(zip, &zip_stat) == -1)
+		{
+			fprintf(stderr, "bench: can't stat %s\n", argv[z]);
+			return 1;
+		}
+		name = strrchr(argv[z], '/');
+		name = name ? name + 1 : argv[z];
+
+		for (m = 0; m < 3; m++)
+		{
+			snprintf(out, sizeof(out), "%s/out%s", argv[2], m == 2 ? "" : m == 0 ? ".tar" : ".tgz");
+			for (r = 0; r < runs; r++)
+			{
+				if (bench_one(baghand, modes[m], zip, out, 0, &run) == -1)
+					return 1;
+				if (r == 0 || run.wall < best.wall)
+					best = run;
+			}
+			bench_one(baghand, modes[m], zip, out, 1, &run);
+			best.syscalls = run.syscalls;
+			remove_path(out);
+
+			printf("{\"corpus\": ");
+			print_string(name);
+			printf(", \"mode\": \"%s\", \"bytes\": %lld, \"entries\": %llu, \"wall_s\": %.6f, \"user_s\": %.6f, \"sys_s\": %.6f, \"mb_s\": %.2f, \"entries_s\": %.0f, \"syscalls\": %ld}\n",
+				modes[m], (long long)zip_stat.st_size, (unsigned long long)best.entries, best.wall, best.user, best.sys,
+				best.wall > 0 ? zip_stat.st_size / best.wall / 1e6 : 0,
+				best.wall > 0 ? best.entries / best.wall : 0, best.syscalls);
+			fflush(stdout);
+		}
+		free(zip);
+	}
+	free(baghand);
+
+	return 0;
+}
@@ -0,0 +1,401 @@
+// zipgen - writes reproducible synthetic zip files to benchmark baghand with.
+// The same shape and scale always give the same zip, byte for byte.
+//
+//	zipgen <shape> <zip file> [scale]
+//
+// shapes:
+//	tiny      lots of entries of a few hundred bytes, mostly deflated
+//	huge      a few entries of hundreds of MiB, stored and deflated
+//	mixed     stored and deflated entries of every size up to 256 KiB
+//	longnames entries with names of 100 to 250 bytes (tar header prefix)
+//	comment   a small zip behind a 65535 byte comment full of fake eocds
+//
+// scale multiplies the number of entries (or their size for huge).
+// Deflated data is a single fixed Huffman block of literals, which is
+// valid deflate but doesn't compress. baghand never looks inside it.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ZIP_FILE_MAGIC 0x04034b50
+#define ZIP_CD_MAGIC   0x02014b50
+#define ZIP_EOCD_MAGIC 0x06054b50
+#define ZIP64_EOCD_MAGIC   0x06064b50
+#define ZIP64_LOCATOR_MAGIC 0x07064b50
+#define ZIP_ALG_STORE 0
+#define ZIP_ALG_DEFLATE 8
+
+#define CHUNK (1024 * 1024)
+
+struct gen_entry
+{
+	char *name;
+	uint64_t offset;
+	uint64_t zip_size;
+	uint64_t unzip_size;
+	uint32_t crc32;
+	uint16_t compression;
+};
+
+struct zipgen
+{
+	FILE *out;
+	uint64_t pos;
+	struct gen_entry *entries;
+	uint32_t count, capacity;
+	uint64_t rng;
+	// the deflate bit writer
+	uint64_t bitbuf;
+	int bitcnt;
+	unsigned char *buffer;
+	size_t buffer_len;
+};
+
+static uint32_t crc_table[256];
+static uint16_t fixed_code[256]; // bit reversed, ready to write
+static uint8_t fixed_len[256];
+
+static void tables_init(void)
+{
+	uint32_t c;
+	int n, k, code, len;
+
+	for (n = 0; n < 256; n++)
+	{
+		c = n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+
+		// fixed literal codes: 0-143 are 00110000 up in 8 bits, 144-255 are
+		// 110010000 up in 9 bits. Huffman codes go out most significant bit first.
+		code = n < 144 ? 0x30 + n : 0x190 + (n - 144);
+		len = n < 144 ? 8 : 9;
+		fixed_len[n] = len;
+		fixed_code[n] = 0;
+		for (k = 0; k < len; k++)
+			if (code & (1 << k))
+				fixed_code[n] |= 1 << (len - 1 - k);
+	}
+}
+
+static uint32_t update_crc(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	crc = ~crc;
+	while (len-- > 0)
+		crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+// xorshift64*, so that every run gives the same zip
+static uint64_t gen_random(struct zipgen *g)
+{
+	g->rng ^= g->rng >> 12;
+	g->rng ^= g->rng << 25;
+	g->rng ^= g->rng >> 27;
+	return g->rng * 2685821657736338717ULL;
+}
+
+// Text that looks a bit like text
+static void gen_fill(struct zipgen *g, unsigned char *buf, size_t len)
+{
+	static const char *words[] = {"the ", "zip ", "bag ", "hand ", "tar ", "of ", "gzip ", "file\n", "deflate ", "stored "};
+	const char *w;
+	size_t i = 0;
+
+	while (i < len)
+		for (w = words[gen_random(g) % 10]; *w && i < len; w++)
+			buf[i++] = *w;
+}
+
+static void out_write(struct zipgen *g, const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, g->out) != len)
+	{
+		perror("zipgen");
+		exit(1);
+	}
+	g->pos += len;
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static void bits_put(struct zipgen *g, uint32_t bits, int len)
+{
+	g->bitbuf |= (uint64_t)bits << g->bitcnt;
+	g->bitcnt += len;
+	while (g->bitcnt >= 8)
+	{
+		g->buffer[g->buffer_len++] = g->bitbuf;
+		g->bitbuf >>= 8;
+		g->bitcnt -= 8;
+	}
+}
+
+static void bits_flush(struct zipgen *g)
+{
+	out_write(g, g->buffer, g->buffer_len);
+	g->buffer_len = 0;
+}
+
+// Writes size bytes of made up data as entry name, stored or deflated
+static void gen_entry(struct zipgen *g, const char *name, uint64_t size, int deflate)
+{
+	unsigned char header[30], *data;
+	struct gen_entry *e;
+	uint64_t left, start;
+	size_t n, i;
+
+	if (g->count == g->capacity)
+	{
+		g->capacity = g->capacity ? g->capacity * 2 : 1024;
+		g->entries = realloc(g->entries, sizeof(struct gen_entry) * g->capacity);
+		if (!g->entries)
+			exit(1);
+	}
+	e = &g->entries[g->count++];
+	e->name = strdup(name);
+	e->offset = g->pos;
+	e->unzip_size = size;
+	e->compression = deflate ? ZIP_ALG_DEFLATE : ZIP_ALG_STORE;
+	e->crc32 = 0;
+
+	// the sizes and crc are filled in once the data is written
+	memset(header, 0, sizeof(header));
+	out_write(g, header, sizeof(header));
+	out_write(g, name, strlen(name));
+	start = g->pos;
+
+	data = malloc(CHUNK);
+	if (!data)
+		exit(1);
+	if (deflate)
+		bits_put(g, 1 | 1 << 1, 3); // last block, fixed Huffman codes
+	for (left = size; left > 0; left -= n)
+	{
+		n = left < CHUNK ? left : CHUNK;
+		gen_fill(g, data, n);
+		e->crc32 = update_crc(e->crc32, data, n);
+		if (!deflate)
+		{
+			out_write(g, data, n);
+			continue;
+		}
+		for (i = 0; i < n; i++)
+		{
+			bits_put(g, fixed_code[data[i]], fixed_len[data[i]]);
+			if (g->buffer_len > CHUNK)
+				bits_flush(g);
+		}
+	}
+	if (deflate)
+	{
+		bits_put(g, 0, 7); // end of block
+		if (g->bitcnt > 0)
+			bits_put(g, 0, 8 - g->bitcnt);
+		bits_flush(g);
+	}
+	free(data);
+	e->zip_size = g->pos - start;
+
+	put32(header, ZIP_FILE_MAGIC);
+	put16(header + 4, 20);
+	put16(header + 8, e->compression);
+	put16(header + 12, 0x21); // 1980-01-01
+	put32(header + 14, e->crc32);
+	put32(header + 18, e->zip_size);
+	put32(header + 22, e->unzip_size);
+	put16(header + 26, strlen(name));
+	if (fseeko(g->out, e->offset, SEEK_SET) == -1 ||
+		fwrite(header, 1, sizeof(header), g->out) != sizeof(header) ||
+		fseeko(g->out, 0, SEEK_END) == -1)
+	{
+		perror("zipgen");
+		exit(1);
+	}
+}
+
+// The central directory and its end. More than 65535 entries need the
+// ZIP64 end records, nothing else here gets big enough to.
+static void gen_finish(struct zipgen *g, const unsigned char *comment, uint16_t comment_len)
+{
+	unsigned char record[56];
+	struct gen_entry *e;
+	uint64_t cd_offset = g->pos, cd_size;
+	uint32_t n;
+
+	for (n = 0; n < g->count; n++)
+	{
+		e = &g->entries[n];
+		memset(record, 0, 46);
+		put32(record, ZIP_CD_MAGIC);
+		put16(record + 4, 20);
+		put16(record + 6, 20);
+		put16(record + 10, e->compression);
+		put16(record + 14, 0x21);
+		put32(record + 16, e->crc32);
+		put32(record + 20, e->zip_size);
+		put32(record + 24, e->unzip_size);
+		put16(record + 28, strlen(e->name));
+		put32(record + 42, e->offset);
+		out_write(g, record, 46);
+		out_write(g, e->name, strlen(e->name));
+		free(e->name);
+	}
+	cd_size = g->pos - cd_offset;
+
+	if (g->count >= 0xFFFF)
+	{
+		memset(record, 0, 56);
+		put32(record, ZIP64_EOCD_MAGIC);
+		put64(record + 4, 44);
+		put16(record + 12, 45);
+		put16(record + 14, 45);
+		put64(record + 24, g->count);
+		put64(record + 32, g->count);
+		put64(record + 40, cd_size);
+		put64(record + 48, cd_offset);
+		out_write(g, record, 56);
+
+		memset(record, 0, 20);
+		put32(record, ZIP64_LOCATOR_MAGIC);
+		put64(record + 8, g->pos - 56);
+		put32(record + 16, 1);
+		out_write(g, record, 20);
+	}
+
+	memset(record, 0, 22);
+	put32(record, ZIP_EOCD_MAGIC);
+	put16(record + 8, g->count < 0xFFFF ? g->count : 0xFFFF);
+	put16(record + 10, g->count < 0xFFFF ? g->count : 0xFFFF);
+	put32(record + 12, cd_size);
+	put32(record + 16, cd_offset);
+	put16(record + 20, comment_len);
+	out_write(g, record, 22);
+	out_write(g, comment, comment_len);
+}
+
+int main(int argc, char **argv)
+{
+	struct zipgen g = {0};
+	unsigned char *comment = NULL;
+	uint16_t comment_len = 0;
+	char name[512];
+	uint64_t size;
+	uint32_t i, count;
+	int scale, len;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: zipgen <tiny|huge|mixed|longnames|comment> <zip file> [scale]\n");
+		return 1;
+	}
+	scale = argc > 3 ? atoi(argv[3]) : 1;
+	if (scale < 1)
+		scale = 1;
+
+	tables_init();
+	g.rng = 0x9e3779b97f4a7c15ULL;
+	g.buffer = malloc(CHUNK + 64);
+	g.out = fopen(argv[2], "w+");
+	if (!g.buffer || !g.out)
+	{
+		perror("zipgen");
+		return 1;
+	}
+
+	if (strcmp(argv[1], "tiny") == 0)
+	{
+		count = 100000 * scale;
+		for (i = 0; i < count; i++)
+		{
+			snprintf(name, sizeof(name), "t%07u.txt", i);
+			gen_entry(&g, name, gen_random(&g) % 1024, i % 8 != 0);
+		}
+	}
+	else if (strcmp(argv[1], "huge") == 0)
+	{
+		for (i = 0; i < 4; i++)
+		{
+			snprintf(name, sizeof(name), "huge%u.bin", i);
+			gen_entry(&g, name, (uint64_t)256 * 1024 * 1024 * scale, i % 2);
+		}
+	}
+	else if (strcmp(argv[1], "mixed") == 0)
+	{
+		count = 5000 * scale;
+		for (i = 0; i < count; i++)
+		{
+			// sizes spread evenly over the powers of two
+			size = gen_random(&g) % ((uint64_t)2 << (gen_random(&g) % 18));
+			snprintf(name, sizeof(name), "m%06u.dat", i);
+			gen_entry(&g, name, size, i % 2);
+		}
+	}
+	else if (strcmp(argv[1], "longnames") == 0)
+	{
+		count = 20000 * scale;
+		for (i = 0; i < count; i++)
+		{
+			len = 100 + gen_random(&g) % 151;
+			memset(name, 'n', len);
+			snprintf(name + len - 12, sizeof(name) - len + 12, "%07u.txt", i);
+			gen_entry(&g, name, gen_random(&g) % 4096, 1);
+		}
+	}
+	else if (strcmp(argv[1], "comment") == 0)
+	{
+		count = 1000 * scale;
+		for (i = 0; i < count; i++)
+		{
+			snprintf(name, sizeof(name), "c%06u.txt", i);
+			gen_entry(&g, name, gen_random(&g) % 8192, 1);
+		}
+
+		// fake eocd signatures all the way through, so the search can't
+		// stop early
+		comment_len = 65535;
+		comment = malloc(comment_len);
+		if (!comment)
+			return 1;
+		gen_fill(&g, comment, comment_len);
+		for (i = 0; i + 4 <= comment_len; i += 512)
+			put32(comment + i, ZIP_EOCD_MAGIC);
+	}
+	else
+	{
+		fprintf(stderr, "zipgen: unknown shape %s\n", argv[1]);
+		return 1;
+	}
+
+	gen_finish(&g, comment, comment_len);
+	if (fclose(g.out) != 0)
+	{
+		perror("zipgen");
+		return 1;
+	}
+	free(g.entries);
+	free(g.buffer);
+	free(comment);
+
+	return 0;
+}
@@ -0,0 +1,6492 @@
+// libbaghand - the zip to gz.tar conversions behind baghand, see baghand.h.
+
+#define _GNU_SOURCE // copy_file_range()
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdarg.h>
+
+#include "baghand.h"
+
+//wow, I didn't realize tarball headers were so huge, or all in ascii...
+struct tar_posix_header
+{
+	unsigned char name[100];
+	unsigned char mode[8];
+	unsigned char uid[8];
+	unsigned char gid[8];
+	unsigned char size[12];
+	unsigned char mtime[12];
+	unsigned char chksum[8];
+	unsigned char typeflag;
+	unsigned char linkname[100];
+	unsigned char magic[6];
+	unsigned char version[2];
+	unsigned char uname[32];
+	unsigned char gname[32];
+	unsigned char devmajor[8];
+	unsigned char devminor[8];
+	unsigned char prefix[155];
+	unsigned char pad[12];
+};
+
+#define GZ_MAGIC 0x8b1f
+#define GZ_METHOD_DEFLATE 0x08
+#define GZ_OS_LINUX 0x03
+
+#define GZ_FLAGS_TEXT       0x01 // ascii?
+#define GZ_FLAGS_HEADER_CRC 0x02
+#define GZ_FLAGS_EXTRA      0x04
+#define GZ_FLAGS_NAME_TRUNC 0x08
+#define GZ_FLAGS_ENCRYPTED  0x10
+#define GZ_FLAGS_RESTRICTED 0xE0
+
+struct gz_header
+{
+	uint16_t magic;
+	uint8_t  method;
+	uint8_t  flags; //encrypted, restricted, extra_feild, header_crc, truncated_name
+	uint32_t stamp;
+	uint8_t  extra;
+	uint8_t  os;
+}__attribute__((packed));
+
+struct gz_footer
+{
+	uint32_t crc;
+	uint32_t isize;
+};
+
+#define ZIP_FILE_MAGIC 0x04034b50
+#define ZIP_ALG_STORE 0
+#define ZIP_ALG_DEFLATE 8
+#define ZIP_CD_MAGIC   0x02014b50
+#define ZIP_DESCRIPTOR_MAGIC 0x08074b50
+#define ZIP_FLAG_DESCRIPTOR 0x0008 // sizes and crc come after the data
+#define ZIP_EOCD_MAGIC 0x06054b50
+#define ZIP64_EOCD_MAGIC   0x06064b50
+#define ZIP64_LOCATOR_MAGIC 0x07064b50
+#define ZIP64_EXTRA_ID 0x0001
+
+// sizes and offsets that don't fit are set to this, and moved to a ZIP64 field
+#define ZIP64_SENTINEL 0xFFFFFFFF
+
+struct zip_local_file
+{
+	uint32_t magic;
+	uint16_t min_version;
+	uint16_t flags;
+	uint16_t compression;
+	uint16_t mtime;
+	uint16_t mdate;
+	uint32_t crc32;
+	uint32_t zip_size;
+	uint32_t unzip_size;
+	uint16_t fname_len;
+	uint16_t extra_len;
+	unsigned char *fname;
+	unsigned char *extra;
+}__attribute__((packed));
+
+struct zip_directory
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t min_version;
+	uint16_t flags;
+	uint16_t compression;
+	uint16_t mtime;
+	uint16_t mdate;
+	uint32_t crc32;
+	uint32_t zip_size;
+	uint32_t unzip_size;
+	uint16_t fname_len;
+	uint16_t extra_len;
+	uint16_t comment_len;
+	uint16_t disk;
+	uint16_t iattr;
+	uint32_t eattr; // data alignment is the problem here...
+	uint32_t offset;
+	unsigned char *fname;
+	unsigned char *extra;
+	unsigned char *comment;
+}__attribute__((packed));
+
+// The ZIP64 extra field, with only as many of the values as are needed
+struct zip64_extra
+{
+	uint16_t id;
+	uint16_t len;
+	uint64_t values[3]; // unzip_size, zip_size, offset
+}__attribute__((packed));
+
+// Follows the file data when ZIP_FLAG_DESCRIPTOR is set. Entries with a 
+// ZIP64 extra field in their local header have 8 byte sizes in it.
+struct zip_descriptor
+{
+	uint32_t magic;
+	uint32_t crc32;
+	uint32_t zip_size;
+	uint32_t unzip_size;
+};
+
+struct zip64_descriptor
+{
+	uint32_t magic;
+	uint32_t crc32;
+	uint64_t zip_size;
+	uint64_t unzip_size;
+}__attribute__((packed));
+
+struct zip_eocd
+{
+	uint32_t magic;
+	uint16_t disk_num;
+	uint16_t main_disk;
+	uint16_t central_records;
+	uint16_t total_central_records;
+	uint32_t central_dir_size;
+	uint32_t central_dir_offset;
+	uint16_t comment_len;
+	unsigned char *comment;
+};
+
+// Sits right before the eocd in ZIP64 archives, and points at the ZIP64 eocd
+struct zip64_eocd_locator
+{
+	uint32_t magic;
+	uint32_t disk;
+	uint64_t eocd_offset;
+	uint32_t total_disks;
+}__attribute__((packed));
+
+struct zip64_eocd
+{
+	uint32_t magic;
+	uint64_t eocd_size;
+	uint16_t version;
+	uint16_t min_version;
+	uint32_t disk_num;
+	uint32_t main_disk;
+	uint64_t central_records;
+	uint64_t total_central_records;
+	uint64_t central_dir_size;
+	uint64_t central_dir_offset;
+}__attribute__((packed));
+
+// The zip being read. When map is set the whole file is mapped and all 
+// metadata and file data is served straight out of the mapping, otherwise 
+// everything goes through pread() on fd.
+struct zip_input
+{
+	int fd;
+	off_t size;
+	unsigned char *map;
+};
+
+// A zip arriving front to back on a pipe, read through buffer. offset is 
+// how far into the zip the start of the buffer is.
+struct zip_stream
+{
+	int fd;
+	unsigned char *buffer;
+	size_t pos;
+	size_t len;
+	uint64_t offset;
+	int eof;
+	int positional; // read with pread() up to end, see stream_range()
+	uint64_t end;
+};
+
+// Where the file data of an entry comes from: a range of a zip that can be 
+// read at any offset, or the next bytes of a zip being streamed in.
+struct zip_source
+{
+	struct zip_input *zip;
+	off_t offset;
+	struct zip_stream *stream;
+};
+
+// A central directory record, decoded into only what conversion needs. The 
+// whole directory is loaded into an array of these up front, so entries can 
+// be walked (or reordered) without going back to the zip file.
+struct zip_entry
+{
+	uint64_t offset; // of the local file header
+	uint64_t zip_size;
+	uint64_t unzip_size;
+	uint32_t crc32;
+	uint32_t dos_time; // MS-DOS date << 16 | time
+	uint32_t name; // offset of the name in zip_table.names
+	uint16_t name_len;
+	uint16_t compression;
+	uint32_t link; // 1 + the index of an earlier entry with the same data, see zip_dedup_table()
+};
+
+struct zip_table
+{
+	struct zip_entry *entries;
+	uint32_t count;
+	unsigned char *names; // all the names, each one NUL terminated
+};
+
+// A stored (uncompressed) deflate block. It's only ever written at a byte 
+// boundary, so the 3 header bits and the padding after them make one byte.
+#define DEFLATE_FINAL  0x01
+#define DEFLATE_STORED 0x00
+#define DEFLATE_STORED_MAX 65535
+
+struct deflate_store_header
+{
+	uint8_t method;
+	uint16_t block_size;
+	uint16_t inverse_size;
+}__attribute__((packed));
+
+// ---------------------- stats ----------------------
+// --stats keeps count of the system calls made, the bytes they moved and 
+// the time spent in them, plus the time spent on the eocd, the central 
+// directory and CRCs, and how long each entry took. It is printed to stderr 
+// on exit, as text or JSON. When it is off all it costs is a branch; when it 
+// is on, a clock_gettime() (no syscall, it's in the vDSO) either side of what 
+// is timed and a few relaxed atomic adds, so it can be left on.
+// With -m the zip is read through page faults, which aren't counted.
+
+enum stat_kind
+{
+	STAT_READ,      // read(), pread()
+	STAT_WRITE,     // write(), pwrite(), writev(), pwritev()
+	STAT_COPY,      // copy_file_range(), sendfile()
+	STAT_OPEN,      // open(), close() and fallocate() of output files
+	STAT_ECHO,      // the names listed on stdout
+	STAT_URING,     // io_uring_enter()
+	STAT_SYSCALLS,  // the kinds above are syscalls, the ones below aren't
+	STAT_CRC = STAT_SYSCALLS,
+	STAT_EOCD,      // finding the eocd
+	STAT_DIRECTORY, // reading the central directory into the table
+	STAT_DEFLATE,   // compressing stored entries, see gather_compress()
+	STAT_KINDS
+};
+
+static const char *stat_names[STAT_KINDS] = {"read", "write", "copy", "open", "echo", "uring", "crc", "eocd", "directory", "deflate"};
+
+// entries are counted by the power of two of microseconds they took
+#define STATS_BUCKETS 32
+
+struct stats
+{
+	int mode;
+	uint64_t start;
+	uint64_t calls[STAT_KINDS];
+	uint64_t bytes[STAT_KINDS];
+	uint64_t ns[STAT_KINDS];
+	uint64_t entries;
+	uint64_t latency[STATS_BUCKETS];
+};
+
+static struct stats stats;
+
+// Nanoseconds on the monotonic clock, or 0 when --stats is off
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	if (!stats.mode)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Counts one call of kind that started at start and moved bytes
+static inline void stats_add(enum stat_kind kind, uint64_t start, uint64_t bytes)
+{
+	if (!stats.mode)
+		return;
+	__atomic_fetch_add(&stats.calls[kind], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats.bytes[kind], bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats.ns[kind], stats_now() - start, __ATOMIC_RELAXED);
+}
+
+// Counts one call of kind that moved bytes, timed as part of another one:
+// an io_uring request, whose time is that of the io_uring_enter() it ran in
+static inline void stats_bytes(enum stat_kind kind, uint64_t bytes)
+{
+	if (!stats.mode)
+		return;
+	__atomic_fetch_add(&stats.calls[kind], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats.bytes[kind], bytes, __ATOMIC_RELAXED);
+}
+
+// Counts an entry that took since start to convert
+static inline void stats_entry(uint64_t start)
+{
+	uint64_t us;
+	int bucket = 0;
+
+	if (!stats.mode)
+		return;
+	for (us = (stats_now() - start) / 1000; us > 0 && bucket < STATS_BUCKETS - 1; us >>= 1)
+		bucket++;
+	__atomic_fetch_add(&stats.entries, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats.latency[bucket], 1, __ATOMIC_RELAXED);
+}
+
+void bh_stats(int mode)
+{
+	stats.mode = mode;
+	stats.start = stats_now();
+}
+
+// Prints the stats to stderr. baghand registers it with atexit() so that 
+// every way out of main() reports them.
+void bh_stats_report(void)
+{
+	double wall = (stats_now() - stats.start) / 1e9;
+	uint64_t syscalls = 0, in, out;
+	int i, last;
+
+	if (!stats.mode)
+		return;
+	for (i = 0; i < STAT_SYSCALLS; i++)
+		syscalls += stats.calls[i];
+	// copies move bytes in and out at once
+	in = stats.bytes[STAT_READ] + stats.bytes[STAT_COPY];
+	out = stats.bytes[STAT_WRITE] + stats.bytes[STAT_COPY];
+	for (last = STATS_BUCKETS - 1; last > 0 && !stats.latency[last]; last--)
+		;
+
+	if (stats.mode == BH_STATS_JSON)
+	{
+		fprintf(stderr, "{\"wall_s\": %.6f, \"entries\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu, \"syscalls\": %llu",
+			wall, (unsigned long long)stats.entries, (unsigned long long)in, (unsigned long long)out, (unsigned long long)syscalls);
+		for (i = 0; i < STAT_KINDS; i++)
+			fprintf(stderr, ", \"%s\": {\"calls\": %llu, \"bytes\": %llu, \"s\": %.6f}", stat_names[i],
+				(unsigned long long)stats.calls[i], (unsigned long long)stats.bytes[i], stats.ns[i] / 1e9);
+		// bucket i is entries that took less than 2^i microseconds
+		fprintf(stderr, ", \"entry_us\": [");
+		for (i = 0; i <= last; i++)
+			fprintf(stderr, "%s%llu", i ? ", " : "", (unsigned long long)stats.latency[i]);
+		fprintf(stderr, "]}\n");
+		return;
+	}
+
+	fprintf(stderr, "%.3f s, %llu entries, %llu bytes in, %llu bytes out, %llu syscalls\n",
+		wall, (unsigned long long)stats.entries, (unsigned long long)in, (unsigned long long)out, (unsigned long long)syscalls);
+	fprintf(stderr, "%-10s %12s %16s %12s\n", "", "calls", "bytes", "seconds");
+	for (i = 0; i < STAT_KINDS; i++)
+		if (stats.calls[i])
+			fprintf(stderr, "%-10s %12llu %16llu %12.6f\n", stat_names[i],
+				(unsigned long long)stats.calls[i], (unsigned long long)stats.bytes[i], stats.ns[i] / 1e9);
+	fprintf(stderr, "entries taking under\n");
+	for (i = 0; i <= last; i++)
+		if (stats.latency[i])
+			fprintf(stderr, "%10llu us %12llu\n", 1ULL << i, (unsigned long long)stats.latency[i]);
+}
+
+// ---------------------- stats end ------------------
+
+// Where the names of converted entries are listed, and what went wrong with
+// them. A library that talks when nobody asked is a nuisance, so both are
+// off until bh_echo() and bh_messages() say otherwise.
+static int echo_fd = -1;
+static FILE *message_file = NULL;
+
+void bh_echo(int fd)
+{
+	echo_fd = fd;
+}
+
+void bh_messages(FILE *file)
+{
+	message_file = file;
+}
+
+static void message(const char *format, ...)
+{
+	va_list args;
+
+	if (!message_file)
+		return;
+	va_start(args, format);
+	vfprintf(message_file, format, args);
+	va_end(args);
+}
+
+// -------------------RFC1952 CRC code--------------------------
+
+/* Tables of CRCs of all 8-bit messages. crc_table[0] is the usual table,
+   crc_table[k][n] is the CRC of n followed by k zero bytes, which is what 
+   lets the slicing kernel handle 8 bytes per step. */
+static uint32_t crc_table[8][256];
+
+/* Make the tables for a fast CRC. */
+static void make_crc_table(void)
+{
+	unsigned long c;
+	int n, k;
+	for (n = 0; n < 256; n++) {
+		  c = (unsigned long) n;
+		  for (k = 0; k < 8; k++) {
+		if (c & 1) {
+		  c = 0xedb88320L ^ (c >> 1);
+		} else {
+		  c = c >> 1;
+		}
+	  }
+	  crc_table[0][n] = c;
+	}
+	for (n = 0; n < 256; n++)
+		for (k = 1; k < 8; k++)
+			crc_table[k][n] = crc_table[0][crc_table[k-1][n] & 0xff] ^ (crc_table[k-1][n] >> 8);
+}
+
+/* The CRC kernels below all work on the pre-conditioned crc c, and the 
+   results of all of them must be identical to crc32_bytewise. */
+
+/* The reference kernel, one byte at a time. */
+static uint32_t crc32_bytewise(uint32_t c, const unsigned char *buf, uint64_t len)
+{
+	while (len--)
+		c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+	return c;
+}
+
+/* Slicing-by-8, the portable kernel. Assumes a little endian machine, like
+   the rest of baghand. */
+static uint32_t crc32_slice8(uint32_t c, const unsigned char *buf, uint64_t len)
+{
+	uint32_t lo, hi;
+
+	while (len >= 8)
+	{
+		memcpy(&lo, buf, 4);
+		memcpy(&hi, buf + 4, 4);
+		lo ^= c;
+		c = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+			crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+			crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+			crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+
+	return crc32_bytewise(c, buf, len);
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* Carry-less multiplication folding, as described in Intel's "Fast CRC
+   Computation for Generic Polynomials Using PCLMULQDQ Instruction". The 
+   constants are x^(d+32) and x^(d-32) mod P, bit reflected and shifted left
+   by one, for folding a 128 bit lane forward by d bits. The low half of a
+   lane is multiplied by the first, the high half by the second. */
+#define CRC_FOLD_2048 0x1322d1430ULL, 0x11542778aULL
+#define CRC_FOLD_512  0x1c6e41596ULL, 0x154442bd4ULL
+#define CRC_FOLD_384  0x174359406ULL, 0x03db1ecdcULL
+#define CRC_FOLD_256  0x15a546366ULL, 0x0f1da05aaULL
+#define CRC_FOLD_128  0x0ccaa009eULL, 0x1751997d0ULL
+#define CRC_FOLD_64   0x163cd6124ULL         /* x^64 mod P */
+#define CRC_BARRETT   0x1f7011641ULL, 0x1db710641ULL /* floor(x^64 / P), P */
+
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i crc32_fold128(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+/* Reduces the 128 bit remainder x to the 32 bit crc */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_reduce128(__m128i x)
+{
+	__m128i k = _mm_set_epi64x(CRC_FOLD_128);
+	__m128i mask = _mm_set_epi32(0, 0, 0, ~0);
+	__m128i t;
+
+	// fold the low 64 bits into the high 64, which also appends 32 zero bits
+	t = _mm_clmulepi64_si128(k, x, 0x01);
+	x = _mm_xor_si128(_mm_srli_si128(x, 8), t);
+
+	// 64 bits down to 32 + 32
+	k = _mm_set_epi64x(0, CRC_FOLD_64);
+	t = _mm_srli_si128(x, 4);
+	x = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x, mask), k, 0x00), t);
+
+	// Barrett reduction of what's left
+	k = _mm_set_epi64x(CRC_BARRETT);
+	t = x;
+	x = _mm_clmulepi64_si128(_mm_and_si128(x, mask), k, 0x10);
+	x = _mm_clmulepi64_si128(_mm_and_si128(x, mask), k, 0x00);
+	x = _mm_xor_si128(x, t);
+
+	return _mm_extract_epi32(x, 1);
+}
+
+/* 64 bytes per step in four 128 bit lanes */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t c, const unsigned char *buf, uint64_t len)
+{
+	__m128i x0, x1, x2, x3, k;
+
+	if (len < 64)
+		return crc32_slice8(c, buf, len);
+
+	x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)buf), _mm_cvtsi32_si128(c));
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+	buf += 64;
+	len -= 64;
+
+	k = _mm_set_epi64x(CRC_FOLD_512);
+	while (len >= 64)
+	{
+		x0 = _mm_xor_si128(crc32_fold128(x0, k), _mm_loadu_si128((const __m128i *)buf));
+		x1 = _mm_xor_si128(crc32_fold128(x1, k), _mm_loadu_si128((const __m128i *)(buf + 16)));
+		x2 = _mm_xor_si128(crc32_fold128(x2, k), _mm_loadu_si128((const __m128i *)(buf + 32)));
+		x3 = _mm_xor_si128(crc32_fold128(x3, k), _mm_loadu_si128((const __m128i *)(buf + 48)));
+		buf += 64;
+		len -= 64;
+	}
+
+	k = _mm_set_epi64x(CRC_FOLD_128);
+	x0 = _mm_xor_si128(crc32_fold128(x0, k), x1);
+	x0 = _mm_xor_si128(crc32_fold128(x0, k), x2);
+	x0 = _mm_xor_si128(crc32_fold128(x0, k), x3);
+	while (len >= 16)
+	{
+		x0 = _mm_xor_si128(crc32_fold128(x0, k), _mm_loadu_si128((const __m128i *)buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	return crc32_slice8(crc32_reduce128(x0), buf, len);
+}
+
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.1")))
+static inline __m512i crc32_fold512(__m512i x, __m512i k, __m512i data)
+{
+	return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00), _mm512_clmulepi64_epi128(x, k, 0x11), data, 0x96);
+}
+
+/* The same folding on 512 bit registers, 256 bytes per step */
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.1")))
+static uint32_t crc32_vpclmul(uint32_t c, const unsigned char *buf, uint64_t len)
+{
+	__m512i z0, z1, z2, z3, k;
+	__m128i x;
+
+	if (len < 256)
+		return crc32_pclmul(c, buf, len);
+
+	z0 = _mm512_xor_si512(_mm512_loadu_si512(buf), _mm512_inserti32x4(_mm512_setzero_si512(), _mm_cvtsi32_si128(c), 0));
+	z1 = _mm512_loadu_si512(buf + 64);
+	z2 = _mm512_loadu_si512(buf + 128);
+	z3 = _mm512_loadu_si512(buf + 192);
+	buf += 256;
+	len -= 256;
+
+	k = _mm512_broadcast_i32x4(_mm_set_epi64x(CRC_FOLD_2048));
+	while (len >= 256)
+	{
+		z0 = crc32_fold512(z0, k, _mm512_loadu_si512(buf));
+		z1 = crc32_fold512(z1, k, _mm512_loadu_si512(buf + 64));
+		z2 = crc32_fold512(z2, k, _mm512_loadu_si512(buf + 128));
+		z3 = crc32_fold512(z3, k, _mm512_loadu_si512(buf + 192));
+		buf += 256;
+		len -= 256;
+	}
+
+	k = _mm512_broadcast_i32x4(_mm_set_epi64x(CRC_FOLD_512));
+	z0 = crc32_fold512(z0, k, z1);
+	z0 = crc32_fold512(z0, k, z2);
+	z0 = crc32_fold512(z0, k, z3);
+	while (len >= 64)
+	{
+		z0 = crc32_fold512(z0, k, _mm512_loadu_si512(buf));
+		buf += 64;
+		len -= 64;
+	}
+
+	// fold the four lanes into the last one
+	x = _mm512_extracti32x4_epi32(z0, 3);
+	x = _mm_xor_si128(x, crc32_fold128(_mm512_extracti32x4_epi32(z0, 0), _mm_set_epi64x(CRC_FOLD_384)));
+	x = _mm_xor_si128(x, crc32_fold128(_mm512_extracti32x4_epi32(z0, 1), _mm_set_epi64x(CRC_FOLD_256)));
+	x = _mm_xor_si128(x, crc32_fold128(_mm512_extracti32x4_epi32(z0, 2), _mm_set_epi64x(CRC_FOLD_128)));
+	while (len >= 16)
+	{
+		x = _mm_xor_si128(crc32_fold128(x, _mm_set_epi64x(CRC_FOLD_128)), _mm_loadu_si128((const __m128i *)buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	return crc32_slice8(crc32_reduce128(x), buf, len);
+}
+#endif
+
+/* x^(2^n) mod P for n = 0..31, used to shift a crc forward by len zero bytes */
+static uint32_t x2n_table[32];
+
+/* Multiply a and b modulo P, in the reflected bit order the crc uses */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31, p = 0;
+
+	for (;;)
+	{
+		if (a & m)
+		{
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+	}
+	return p;
+}
+
+/* x^(n * 2^k) mod P */
+static uint32_t x2nmodp(uint64_t n, unsigned k)
+{
+	uint32_t p = (uint32_t)1 << 31; /* x^0 */
+
+	while (n)
+	{
+		if (n & 1)
+			p = multmodp(x2n_table[k & 31], p);
+		n >>= 1;
+		k++;
+	}
+	return p;
+}
+
+/* Returns the crc of A followed by B, given crc1 of A, and crc2 and the 
+   length of B. This is how gzip member CRCs are made from the zip's CRCs 
+   without ever seeing the decompressed data. */
+static uint32_t crc_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	uint64_t t = stats_now();
+
+	crc1 = multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+	stats_add(STAT_CRC, t, 0);
+	return crc1;
+}
+
+/* The fastest kernel this cpu can run, picked once at startup */
+static uint32_t (*crc32_kernel)(uint32_t c, const unsigned char *buf, uint64_t len) = crc32_slice8;
+
+__attribute__((constructor))
+static void crc_init(void)
+{
+	uint32_t p = (uint32_t)1 << 30; /* x^1 */
+	int n;
+
+	make_crc_table();
+	x2n_table[0] = p;
+	for (n = 1; n < 32; n++)
+		x2n_table[n] = p = multmodp(p, p);
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+		crc32_kernel = crc32_pclmul;
+	if (crc32_kernel == crc32_pclmul && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq"))
+		crc32_kernel = crc32_vpclmul;
+#endif
+}
+
+/*
+ Update a running crc with the bytes buf[0..len-1] and return
+the updated crc. The crc should be initialized to zero. Pre- and
+post-conditioning (one's complement) is performed within this
+function so it shouldn't be done by the caller. Usage example:
+
+ unsigned long crc = 0L;
+
+ while (read_buffer(buffer, length) != EOF) {
+   crc = update_crc(crc, buffer, length);
+ }
+ if (crc != original_crc) error();
+*/
+static uint32_t update_crc(uint32_t crc, const void *buf, uint64_t len)
+{
+	uint64_t t = stats_now();
+
+	crc = crc32_kernel(crc ^ 0xffffffffL, buf, len) ^ 0xffffffffL;
+	stats_add(STAT_CRC, t, len);
+	return crc;
+}
+
+/* Return the CRC of the bytes buf[0..len-1]. */
+static inline uint32_t crc(const void *buf, uint64_t len)
+{
+	return update_crc(0L, buf, len);
+}
+// -------------------RFC1952 CRC code end----------------------
+
+
+
+// this function checks the zip magic and the comment length to see if 
+// the eocd structure has been located. trailing is the number of bytes in the
+// file after the 22 byte eocd, and position is where the eocd starts.
+// In ZIP64 archives the directory location may only be in the ZIP64 eocd.
+static inline int validate_eocd(struct zip_eocd *eocd, uint32_t trailing, off_t position)
+{
+	return (eocd->magic == ZIP_EOCD_MAGIC) && (trailing == eocd->comment_len) &&
+		(eocd->central_dir_offset == ZIP64_SENTINEL || eocd->central_dir_size == ZIP64_SENTINEL ||
+		 (off_t)eocd->central_dir_offset + eocd->central_dir_size <= position);
+}
+
+// This function fills buffer with an ascii encoded octal string representing n
+static void octal(uint64_t n, unsigned char *buffer, int len)
+{
+	int i = 0;
+	for (i = 0; i < len; i++, n = n >> 3)
+		buffer[len-1-i] = (n & 7) + '0';
+}
+
+// This is used to make sure that the end of each tar entry is aligned to 512 bytes
+static const unsigned char padding[512] = {0};
+
+static void tar_set_checksum(struct tar_posix_header *header)
+{
+	uint32_t sum = 0;
+	int i;
+	unsigned char *header_data = (unsigned char *)header;
+	for (i=0; i<8; i++)
+		header->chksum[i] = ' ';
+
+	for (i=0;i<sizeof(struct tar_posix_header); i++)
+		sum += header_data[i];
+
+	octal(sum, header->chksum, 6);
+	header->chksum[6] = '\0';
+}
+
+static inline uint64_t tar_entry_size(uint64_t file_size, uint8_t deflated)
+{
+	return file_size + (deflated ? (sizeof(struct gz_header) + sizeof(struct gz_footer)) : 0);
+}
+
+// The largest size that fits in the 11 octal digits of the size field (8 GiB - 1)
+#define TAR_MAX_OCTAL_SIZE 077777777777ULL
+
+// Sets the size field. Anything too big for octal is written as a GNU base-256
+// number: the high bit of the first byte is set, and the rest of the field 
+// holds the size in big endian binary. GNU tar, bsdtar and busybox read this.
+static void tar_set_size(struct tar_posix_header *header, uint64_t size)
+{
+	int i;
+
+	if (size <= TAR_MAX_OCTAL_SIZE)
+	{
+		octal(size, header->size, 11);
+		return;
+	}
+
+	header->size[0] = 0x80;
+	for (i = sizeof(header->size) - 1; i > 0; i--, size >>= 8)
+		header->size[i] = size & 0xff;
+}
+
+// A name of more than 100 bytes has to be split at a '/' into a ustar 
+// prefix of up to 155 bytes and a name of up to 100 after it. Returns where
+// the '/' is (0 for a name that fits as it is), or -1 if there's nowhere to
+// split it.
+static int tar_name_split(const unsigned char *fname, size_t len)
+{
+	size_t i;
+
+	if (len <= sizeof(((struct tar_posix_header *)0)->name))
+		return 0;
+	for (i = len - 101; i <= 155 && i + 1 < len; i++)
+		if (fname[i] == '/' && i > 0)
+			return i;
+
+	return -1;
+}
+
+// Fills in the header of a regular file of the given size. The header must 
+// start out zeroed. A name that can't be split only has its first 100 
+// bytes here, the whole of it goes in a record before, see tar_long_name().
+static void tar_header_fill(struct tar_posix_header *tar_header, const unsigned char *fname, uint64_t size)
+{
+	size_t len = strlen((const char *)fname);
+	int i, split = tar_name_split(fname, len);
+
+	if (split > 0)
+	{
+		memcpy(tar_header->prefix, fname, split);
+		memcpy(tar_header->name, fname + split + 1, len - split - 1);
+	}
+	else
+		memcpy(tar_header->name, fname, len < sizeof(tar_header->name) ? len : sizeof(tar_header->name));
+
+	for (i=0; i < 7; i++)
+	{
+		tar_header->mode[i] = '0';
+		tar_header->gid[i] = '0';
+		tar_header->uid[i] = '0';
+		tar_header->mtime[i] = '0';
+	}
+	tar_header->typeflag = '0';
+
+	tar_set_size(tar_header, size);
+
+	// old GNU magic, "ustar " followed by a version of " \0", which tar
+	// doesn't look for a prefix behind. With a prefix it's POSIX ustar.
+	if (split > 0)
+		memcpy(tar_header->magic, "ustar\0" "00", 8);
+	else
+		memcpy(tar_header->magic, "ustar  ", 8);
+
+	tar_set_checksum(tar_header);
+}
+
+// A name that can't be split for a ustar header gets a GNU long name record 
+// in front of the header: a header called ././@LongLink of type 'L', with 
+// the name and a NUL as its data. Names are kept to what fits in the 512 
+// bytes entry_name() is mostly given.
+#define TAR_LONG_NAME_MAX 511
+
+// The size of the long name record fname needs, 0 if it doesn't need one
+static inline uint32_t tar_long_name_len(const unsigned char *fname, size_t len)
+{
+	if (tar_name_split(fname, len) != -1)
+		return 0;
+	return sizeof(struct tar_posix_header) + (len + 1 + 511) / 512 * 512;
+}
+
+// Writes the long name record of fname, if it needs one, to block, which 
+// has room for 1024 bytes. Returns its size.
+static uint32_t tar_long_name(unsigned char *block, const unsigned char *fname)
+{
+	struct tar_posix_header *header = (struct tar_posix_header *)block;
+	size_t len = strlen((const char *)fname);
+	uint32_t n = tar_long_name_len(fname, len);
+
+	if (n == 0)
+		return 0;
+	memset(block, 0, n);
+	tar_header_fill(header, (const unsigned char *)"././@LongLink", len + 1);
+	header->typeflag = 'L';
+	tar_set_checksum(header);
+	memcpy(block + sizeof(struct tar_posix_header), fname, len);
+
+	return n;
+}
+
+// Turns a filled in header into a hard link to target, which has to fit in 
+// the 100 bytes of linkname. The size should have been 0.
+static void tar_header_link(struct tar_posix_header *tar_header, const unsigned char *target)
+{
+	memcpy(tar_header->linkname, target, strlen((const char *)target));
+	tar_header->typeflag = '1';
+	tar_set_checksum(tar_header);
+}
+
+// Size of the bounce buffer used when the kernel can't move the data for us
+#define COPY_BUFFER_SIZE 65536
+
+// write() that doesn't give up on short writes
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t t;
+	ssize_t n;
+
+	while (len > 0)
+	{
+		t = stats_now();
+		n = write(fd, p, len);
+		stats_add(STAT_WRITE, t, n > 0 ? n : 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// write_all() at *offset, which is moved past what was written
+static int pwrite_all(int fd, const void *buf, size_t len, off_t *offset)
+{
+	const unsigned char *p = buf;
+	uint64_t t;
+	ssize_t n;
+
+	while (len > 0)
+	{
+		t = stats_now();
+		n = pwrite(fd, p, len, *offset);
+		stats_add(STAT_WRITE, t, n > 0 ? n : 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+		*offset += n;
+	}
+
+	return 0;
+}
+
+// ---------------------- copy pipeline ----------------------
+
+// What the kernel can't copy for us goes through user space. For a big entry
+// that's a ring of buffers: a reader thread fills them with pread() while the
+// calling thread writes out the ones already full, so reading and writing 
+// overlap, and memory use is the size of the ring however big the entry is.
+// The ring is pipe_memory bytes (see bh_max_memory()), or PIPE_SLOTS 
+// PIPE_SLOT_SIZE buffers if it's 0.
+#define PIPE_SLOTS 4
+#define PIPE_SLOT_SIZE (1024 * 1024)
+#define PIPE_SLOT_MIN 4096
+
+static size_t pipe_memory = 0;
+
+struct copy_pipe
+{
+	int in_fd;
+	off_t in_off;
+	uint64_t left; // still to be read
+	size_t slot_size;
+	unsigned char *slots[PIPE_SLOTS];
+	size_t filled[PIPE_SLOTS];
+	uint64_t head, tail; // how many slots have been read and written
+	int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // head, tail or failed moved
+};
+
+void bh_max_memory(size_t bytes)
+{
+	pipe_memory = bytes;
+}
+
+static void *pipe_reader(void *arg)
+{
+	struct copy_pipe *p = arg;
+	unsigned char *buf;
+	size_t len, done;
+	uint64_t t;
+	ssize_t n;
+	int failed;
+
+	while (p->left > 0)
+	{
+		pthread_mutex_lock(&p->lock);
+		while (p->head - p->tail == PIPE_SLOTS && !p->failed)
+			pthread_cond_wait(&p->cond, &p->lock);
+		failed = p->failed;
+		pthread_mutex_unlock(&p->lock);
+		if (failed)
+			break;
+
+		buf = p->slots[p->head % PIPE_SLOTS];
+		len = p->left < p->slot_size ? p->left : p->slot_size;
+		for (done = 0; done < len; done += n)
+		{
+			t = stats_now();
+			n = pread(p->in_fd, buf + done, len - done, p->in_off + done);
+			stats_add(STAT_READ, t, n > 0 ? n : 0);
+			if (n == -1 && errno == EINTR)
+				n = 0;
+			else if (n <= 0)
+				break;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		if (done < len)
+			p->failed = 1;
+		else
+		{
+			p->filled[p->head % PIPE_SLOTS] = len;
+			p->head++;
+			p->in_off += len;
+			p->left -= len;
+		}
+		failed = p->failed;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		if (failed)
+			break;
+	}
+
+	return NULL;
+}
+
+// Copies len bytes at in_off in in_fd to out_fd like fd_copy(), or to send()
+// if it isn't NULL. Returns -2 without copying anything if there's no memory
+// or thread for the ring, so that the caller can do it the slow way.
+static int pipe_copy(int in_fd, off_t in_off, uint64_t len, int out_fd, off_t *out_off, int (*send)(void *ctx, const void *buf, size_t len), void *ctx)
+{
+	struct copy_pipe p;
+	pthread_t reader;
+	unsigned char *buffer;
+	size_t n;
+	int i, failed, ret = 0;
+
+	memset(&p, 0, sizeof(struct copy_pipe));
+	p.in_fd = in_fd;
+	p.in_off = in_off;
+	p.left = len;
+	p.slot_size = pipe_memory ? pipe_memory / PIPE_SLOTS : PIPE_SLOT_SIZE;
+	if (p.slot_size > (len + PIPE_SLOTS - 1) / PIPE_SLOTS)
+		p.slot_size = (len + PIPE_SLOTS - 1) / PIPE_SLOTS;
+	if (p.slot_size < PIPE_SLOT_MIN)
+		p.slot_size = PIPE_SLOT_MIN;
+
+	buffer = malloc(p.slot_size * PIPE_SLOTS);
+	if (!buffer)
+		return -2;
+	for (i = 0; i < PIPE_SLOTS; i++)
+		p.slots[i] = buffer + p.slot_size * i;
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	if (pthread_create(&reader, NULL, pipe_reader, &p) != 0)
+	{
+		pthread_cond_destroy(&p.cond);
+		pthread_mutex_destroy(&p.lock);
+		free(buffer);
+		return -2;
+	}
+
+	while (len > 0)
+	{
+		pthread_mutex_lock(&p.lock);
+		while (p.head == p.tail && !p.failed)
+			pthread_cond_wait(&p.cond, &p.lock);
+		failed = p.failed;
+		pthread_mutex_unlock(&p.lock);
+		if (failed)
+		{
+			ret = -1;
+			break;
+		}
+
+		i = p.tail % PIPE_SLOTS;
+		n = p.filled[i];
+		if (send)
+			ret = send(ctx, p.slots[i], n);
+		else
+			ret = out_off ? pwrite_all(out_fd, p.slots[i], n, out_off) : write_all(out_fd, p.slots[i], n);
+		len -= n;
+
+		pthread_mutex_lock(&p.lock);
+		if (ret == -1)
+			p.failed = 1;
+		else
+			p.tail++;
+		pthread_cond_broadcast(&p.cond);
+		pthread_mutex_unlock(&p.lock);
+		if (ret == -1)
+			break;
+	}
+
+	pthread_join(reader, NULL);
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.lock);
+	free(buffer);
+
+	return ret;
+}
+
+// ---------------------- copy pipeline end ------------------
+
+// Copies len bytes starting at in_off in in_fd to out_fd, at *out_off if 
+// out_off isn't NULL (and moves it along) or else at the current position.
+// copy_file_range() is tried first since it never brings the data into user 
+// space (and can reflink on some filesystems), then sendfile(), which still 
+// works when out_fd is a pipe or socket. If neither will do it, fall back to 
+// a copy through user space, see pipe_copy(), so memory use doesn't depend 
+// on len. The file position of in_fd is not used or changed.
+static int fd_copy(int in_fd, off_t in_off, int out_fd, off_t *out_off, uint64_t len)
+{
+	unsigned char buffer[COPY_BUFFER_SIZE];
+	uint64_t t;
+	ssize_t n;
+	int ret;
+
+	while (len > 0)
+	{
+		t = stats_now();
+		n = copy_file_range(in_fd, &in_off, out_fd, out_off, len, 0);
+		stats_add(STAT_COPY, t, n > 0 ? n : 0);
+		if (n > 0)
+		{
+			len -= n;
+			continue;
+		}
+		if (n == 0) // unexpected end of the zip file
+			return -1;
+		if (errno == EINTR)
+			continue;
+		if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EBADF && errno != EOPNOTSUPP)
+			return -1;
+		break;
+	}
+
+	// sendfile() can only write at the file position
+	while (len > 0 && !out_off)
+	{
+		t = stats_now();
+		n = sendfile(out_fd, in_fd, &in_off, len);
+		stats_add(STAT_COPY, t, n > 0 ? n : 0);
+		if (n > 0)
+		{
+			len -= n;
+			continue;
+		}
+		if (n == 0)
+			return -1;
+		if (errno == EINTR)
+			continue;
+		if (errno != EINVAL && errno != ENOSYS)
+			return -1;
+		break;
+	}
+
+	if (len > COPY_BUFFER_SIZE)
+	{
+		ret = pipe_copy(in_fd, in_off, len, out_fd, out_off, NULL, NULL);
+		if (ret != -2)
+			return ret;
+	}
+
+	while (len > 0)
+	{
+		t = stats_now();
+		n = pread(in_fd, buffer, len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE, in_off);
+		stats_add(STAT_READ, t, n > 0 ? n : 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		in_off += n;
+		len -= n;
+
+		if ((out_off ? pwrite_all(out_fd, buffer, n, out_off) : write_all(out_fd, buffer, n)) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+// Opens the zip file, and maps it if use_map is set. If the mapping can't be 
+// made (empty file, not enough address space) the input quietly stays on pread().
+static int zip_input_open(struct zip_input *in, const char *path, int use_map)
+{
+	struct stat st;
+
+	in->map = NULL;
+	in->fd = open(path, O_RDONLY, 0);
+	if (in->fd == -1)
+		return -1;
+
+	if (fstat(in->fd, &st) == -1)
+	{
+		close(in->fd);
+		return -1;
+	}
+	in->size = st.st_size;
+
+	if (use_map && in->size > 0 && (uintmax_t)in->size <= SIZE_MAX)
+	{
+		in->map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+		if (in->map == MAP_FAILED)
+			in->map = NULL;
+		else // file data is read front to back, so let the kernel read ahead aggressively
+			madvise(in->map, in->size, MADV_SEQUENTIAL);
+	}
+
+	return 0;
+}
+
+static void zip_input_close(struct zip_input *in)
+{
+	if (in->map)
+		munmap(in->map, in->size);
+	close(in->fd);
+}
+
+// Hints that the range [offset, offset+len) will be needed soon. The kernel
+// starts reading it in the background, as one request if it can.
+static void zip_input_willneed(struct zip_input *in, off_t offset, off_t len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	off_t start = offset & ~(off_t)(page - 1);
+
+	if (offset < 0 || offset + len > in->size)
+		return;
+
+	if (in->map)
+		madvise(in->map + start, len + (offset - start), MADV_WILLNEED);
+	else
+		posix_fadvise(in->fd, offset, len, POSIX_FADV_WILLNEED);
+}
+
+// Drops the mapped range [offset, offset+len) from memory once it's been 
+// written, so that a big entry doesn't stay resident behind the copy
+static void zip_input_release(struct zip_input *in, off_t offset, off_t len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	off_t start = offset & ~(off_t)(page - 1);
+
+	if (!in->map || offset < 0 || offset + len > in->size)
+		return;
+
+	madvise(in->map + start, len + (offset - start), MADV_DONTNEED);
+}
+
+// Returns a pointer to len bytes at offset inside the mapping, or NULL if the 
+// zip isn't mapped or the range runs past the end of the file.
+static const unsigned char *zip_input_ptr(struct zip_input *in, off_t offset, size_t len)
+{
+	if (!in->map || offset < 0 || offset > in->size || len > (size_t)(in->size - offset))
+		return NULL;
+
+	return in->map + offset;
+}
+
+// Reads exactly len bytes at offset, from the mapping or with pread(). Returns
+// -1 if the zip file is shorter than that.
+static int zip_input_read(struct zip_input *in, void *buf, size_t len, off_t offset)
+{
+	const unsigned char *p;
+	unsigned char *dst = buf;
+	uint64_t t;
+	ssize_t n;
+
+	if (in->map)
+	{
+		p = zip_input_ptr(in, offset, len);
+		if (!p)
+			return -1;
+		memcpy(buf, p, len);
+		return 0;
+	}
+
+	while (len > 0)
+	{
+		t = stats_now();
+		n = pread(in->fd, dst, len, offset);
+		stats_add(STAT_READ, t, n > 0 ? n : 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		dst += n;
+		offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Copies len bytes of file data at offset to out_fd, at *out_off like 
+// fd_copy(). A mapped zip is written straight out of the mapping.
+static int zip_input_copy(struct zip_input *in, off_t offset, int out_fd, off_t *out_off, uint64_t len)
+{
+	const unsigned char *p;
+
+	if (!in->map)
+		return fd_copy(in->fd, offset, out_fd, out_off, len);
+
+	p = zip_input_ptr(in, offset, len);
+	if (!p)
+		return -1;
+	return out_off ? pwrite_all(out_fd, p, len, out_off) : write_all(out_fd, p, len);
+}
+
+// ---------------------- streaming input ----------------------
+
+#define STREAM_BUFFER_SIZE (256 * 1024)
+
+static int stream_open(struct zip_stream *st, int fd)
+{
+	st->fd = fd;
+	st->pos = 0;
+	st->len = 0;
+	st->offset = 0;
+	st->eof = 0;
+	st->positional = 0;
+	st->end = 0;
+	st->buffer = malloc(STREAM_BUFFER_SIZE);
+
+	return st->buffer ? 0 : -1;
+}
+
+static void stream_close(struct zip_stream *st)
+{
+	free(st->buffer);
+}
+
+// Points an open stream at the len bytes of fd at offset. They're read with 
+// pread(), so any number of streams can share fd, and the stream ends after 
+// them.
+static void stream_range(struct zip_stream *st, int fd, uint64_t offset, uint64_t len)
+{
+	st->fd = fd;
+	st->pos = 0;
+	st->len = 0;
+	st->offset = offset;
+	st->eof = 0;
+	st->positional = 1;
+	st->end = offset + len;
+}
+
+// Where in the zip the next unread byte is
+static inline uint64_t stream_tell(struct zip_stream *st)
+{
+	return st->offset + st->pos;
+}
+
+// Makes sure at least want bytes (up to the buffer size) are buffered, unless
+// the zip ends first. Returns the number of bytes buffered.
+static size_t stream_fill(struct zip_stream *st, size_t want)
+{
+	uint64_t t, left;
+	ssize_t n;
+
+	if (want > STREAM_BUFFER_SIZE)
+		want = STREAM_BUFFER_SIZE;
+	if (st->len - st->pos >= want || st->eof)
+		return st->len - st->pos;
+
+	// move what's left to the front to make room
+	memmove(st->buffer, st->buffer + st->pos, st->len - st->pos);
+	st->offset += st->pos;
+	st->len -= st->pos;
+	st->pos = 0;
+
+	while (st->len < want)
+	{
+		left = STREAM_BUFFER_SIZE - st->len;
+		if (st->positional && left > st->end - (st->offset + st->len))
+			left = st->end - (st->offset + st->len);
+		if (left == 0)
+		{
+			st->eof = 1;
+			break;
+		}
+
+		t = stats_now();
+		if (st->positional)
+			n = pread(st->fd, st->buffer + st->len, left, st->offset + st->len);
+		else
+			n = read(st->fd, st->buffer + st->len, left);
+		stats_add(STAT_READ, t, n > 0 ? n : 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			st->eof = 1;
+			break;
+		}
+		st->len += n;
+	}
+
+	return st->len - st->pos;
+}
+
+// Reads exactly len bytes, or returns -1
+static int stream_read(struct zip_stream *st, void *buf, size_t len)
+{
+	unsigned char *dst = buf;
+	size_t n;
+
+	while (len > 0)
+	{
+		n = stream_fill(st, len);
+		if (n == 0)
+			return -1;
+		if (n > len)
+			n = len;
+		memcpy(dst, st->buffer + st->pos, n);
+		st->pos += n;
+		dst += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Skips the next len bytes
+static int stream_skip(struct zip_stream *st, uint64_t len)
+{
+	size_t n;
+
+	while (len > 0)
+	{
+		n = stream_fill(st, 1);
+		if (n == 0)
+			return -1;
+		if (n > len)
+			n = len;
+		st->pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Copies the next len bytes to out_fd. Whatever is already buffered goes 
+// first, the rest is spliced straight from the input pipe when possible.
+static int stream_copy(struct zip_stream *st, int out_fd, uint64_t len)
+{
+	size_t n;
+	ssize_t r;
+
+	n = st->len - st->pos;
+	if (n > len)
+		n = len;
+	if (write_all(out_fd, st->buffer + st->pos, n) == -1)
+		return -1;
+	st->pos += n;
+	len -= n;
+	if (len == 0)
+		return 0;
+
+	// the buffer is empty now, so the input can be read around it
+	st->offset += st->len;
+	st->pos = st->len = 0;
+	while (len > 0 && !st->eof)
+	{
+		r = splice(st->fd, NULL, out_fd, NULL, len < (1 << 30) ? len : (1 << 30), SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (r > 0)
+		{
+			st->offset += r;
+			len -= r;
+			continue;
+		}
+		if (r == 0)
+			return -1;
+		if (errno == EINTR)
+			continue;
+		if (errno != EINVAL)
+			return -1;
+		break; // neither end is a pipe
+	}
+
+	while (len > 0)
+	{
+		n = stream_fill(st, 1);
+		if (n == 0)
+			return -1;
+		if (n > len)
+			n = len;
+		if (write_all(out_fd, st->buffer + st->pos, n) == -1)
+			return -1;
+		st->pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Reads the data of an entry that has its crc and sizes after it, in a data
+// descriptor, into spool_fd and fills them into entry. The data is searched 
+// for the descriptor signature, and a signature only counts when the 
+// compressed size after it matches the number of bytes before it. 
+// Descriptors without a signature aren't supported.
+static int stream_spool(struct zip_stream *st, int spool_fd, struct zip_entry *entry, int zip64)
+{
+	uint32_t magic = ZIP_DESCRIPTOR_MAGIC, size32;
+	uint64_t n = 0, size64;
+	const unsigned char *p, *q;
+	size_t avail, chunk, skip;
+
+	for (;;)
+	{
+		// enough for a signature and the biggest descriptor after it
+		avail = stream_fill(st, 4 + 24);
+		if (avail < 16)
+			return -1;
+		p = st->buffer + st->pos;
+		q = memmem(p, avail, &magic, 4);
+		skip = 0;
+
+		if (!q)
+		{
+			if (st->eof)
+				return -1;
+			chunk = avail - 3; // the signature might start in the last 3 bytes
+		}
+		else if ((size_t)(q - p) + 16 > avail || (zip64 && (size_t)(q - p) + 24 > avail && !st->eof))
+		{
+			// the whole descriptor isn't buffered yet, move up to it first
+			chunk = q - p;
+			if (chunk == 0)
+				return -1;
+		}
+		else
+		{
+			chunk = q - p;
+			memcpy(&size32, q + 8, 4);
+			if (!zip64 && n + chunk == size32)
+			{
+				entry->zip_size = size32;
+				memcpy(&size32, q + 12, 4);
+				entry->unzip_size = size32;
+				skip = 16;
+			}
+			else if (zip64 && (size_t)(q - p) + 24 <= avail && (memcpy(&size64, q + 8, 8), n + chunk == size64))
+			{
+				entry->zip_size = size64;
+				memcpy(&entry->unzip_size, q + 16, 8);
+				skip = 24;
+			}
+			else
+				chunk += 1; // just data that looks like a signature
+		}
+
+		if (write_all(spool_fd, p, chunk) == -1)
+			return -1;
+		n += chunk;
+		st->pos += chunk;
+
+		if (skip)
+		{
+			memcpy(&entry->crc32, st->buffer + st->pos + 4, 4);
+			st->pos += skip;
+			return 0;
+		}
+	}
+}
+
+// ---------------------- streaming input end ------------------
+
+// Returns the offset of the file data of dir_entry, which sits after the local
+// file header. The local header has its own name and extra lengths, which don't
+// always match the ones in the central directory.
+static off_t zip_data_offset(struct zip_input *in, struct zip_entry *dir_entry)
+{
+	struct zip_local_file file_entry;
+
+	if (zip_input_read(in, &file_entry, 30, dir_entry->offset) == -1 || file_entry.magic != ZIP_FILE_MAGIC)
+		return -1;
+
+	return (off_t)dir_entry->offset + 30 + file_entry.fname_len + file_entry.extra_len;
+}
+
+// Points src at the file data of dir_entry in zip
+static int zip_source_entry(struct zip_source *src, struct zip_input *zip, struct zip_entry *dir_entry)
+{
+	src->zip = zip;
+	src->stream = NULL;
+	src->offset = zip_data_offset(zip, dir_entry);
+
+	return src->offset == -1 ? -1 : 0;
+}
+
+// An earlier tarball made from (an earlier version of) the same zip. The 
+// data of entries that haven't changed since is copied out of it instead of
+// the zip, see index_base().
+struct zip_base
+{
+	struct zip_input tar;
+	off_t *offsets; // where each entry's data is in tar, or -1 if it has to come from the zip
+};
+
+// Points src at the file data of entry n of table, in base if it's there
+static int base_source_entry(struct zip_source *src, struct zip_base *base, struct zip_input *zip, struct zip_table *table, uint32_t n)
+{
+	if (!base || !base->offsets || base->offsets[n] == -1)
+		return zip_source_entry(src, zip, &table->entries[n]);
+
+	src->zip = &base->tar;
+	src->stream = NULL;
+	src->offset = base->offsets[n];
+
+	return 0;
+}
+
+// Copies the next len bytes of file data from src to out_fd, at *out_off 
+// like fd_copy(). A stream can only be written at the file position.
+static int source_copy(struct zip_source *src, int out_fd, off_t *out_off, uint64_t len)
+{
+	if (src->stream)
+		return out_off ? -1 : stream_copy(src->stream, out_fd, len);
+
+	if (zip_input_copy(src->zip, src->offset, out_fd, out_off, len) == -1)
+		return -1;
+	src->offset += len;
+
+	return 0;
+}
+
+// Hands the next len bytes of file data from src to send(), through a buffer
+static int source_send(struct zip_source *src, int (*send)(void *ctx, const void *buf, size_t len), void *ctx, uint64_t len)
+{
+	unsigned char buffer[COPY_BUFFER_SIZE];
+	size_t n;
+	int ret;
+
+	if (!src->stream && !src->zip->map && len > COPY_BUFFER_SIZE)
+	{
+		ret = pipe_copy(src->zip->fd, src->offset, len, -1, NULL, send, ctx);
+		if (ret != -2)
+		{
+			src->offset += len;
+			return ret;
+		}
+	}
+
+	for (; len > 0; len -= n)
+	{
+		n = len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE;
+		if (src->stream && stream_read(src->stream, buffer, n) == -1)
+			return -1;
+		if (!src->stream && zip_input_read(src->zip, buffer, n, src->offset) == -1)
+			return -1;
+		if (!src->stream)
+			src->offset += n;
+		if (send(ctx, buffer, n) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+// ---------------------- worker pool --------------------------
+
+// Each worker owns a range of job indices and takes jobs from the front of 
+// it. A worker that runs out steals the back half of the biggest range left,
+// so one huge entry doesn't leave the other threads idle behind it.
+struct pool_range
+{
+	pthread_mutex_t lock;
+	uint32_t next;
+	uint32_t end;
+}__attribute__((aligned(64))); // one cache line each, they're hammered by different threads
+
+struct pool
+{
+	int threads;
+	struct pool_range *ranges;
+	int (*job)(void *arg, uint32_t index, int worker);
+	void *arg;
+	int failed;
+};
+
+struct pool_worker
+{
+	struct pool *pool;
+	int id;
+};
+
+// Takes the next job for worker id, stealing if its own range is empty. 
+// Returns 0 when there's nothing left anywhere.
+static int pool_next(struct pool *pool, int id, uint32_t *index)
+{
+	struct pool_range *own = &pool->ranges[id], *victim;
+	uint32_t best, left, mid;
+	int i, v;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&own->lock);
+		if (own->next < own->end)
+		{
+			*index = own->next++;
+			pthread_mutex_unlock(&own->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&own->lock);
+
+		// find the biggest range without locking, it's only a guess
+		for (i = 0, v = -1, best = 0; i < pool->threads; i++)
+		{
+			left = __atomic_load_n(&pool->ranges[i].end, __ATOMIC_RELAXED) - __atomic_load_n(&pool->ranges[i].next, __ATOMIC_RELAXED);
+			if (i != id && left > best && left <= UINT32_MAX / 2)
+			{
+				best = left;
+				v = i;
+			}
+		}
+		if (v == -1)
+			return 0;
+
+		victim = &pool->ranges[v];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->next >= victim->end)
+		{
+			// somebody got there first, look again
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		mid = victim->next + (victim->end - victim->next) / 2;
+		pthread_mutex_lock(&own->lock);
+		own->next = mid;
+		own->end = victim->end;
+		pthread_mutex_unlock(&own->lock);
+		victim->end = mid;
+		pthread_mutex_unlock(&victim->lock);
+	}
+}
+
+static void *pool_thread(void *arg)
+{
+	struct pool_worker *worker = arg;
+	struct pool *pool = worker->pool;
+	uint32_t index;
+
+	while (pool_next(pool, worker->id, &index))
+		if (pool->job(pool->arg, index, worker->id) == -1)
+			__atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+// Runs job(arg, index, worker) for every index in [0, count) on threads 
+// threads. Returns -1 if any of the jobs did.
+static int pool_run(int threads, uint32_t count, int (*job)(void *arg, uint32_t index, int worker), void *arg)
+{
+	struct pool pool;
+	struct pool_worker *workers;
+	pthread_t *tids;
+	int i, started;
+
+	if (threads < 1)
+		threads = 1;
+	if ((uint32_t)threads > count)
+		threads = count ? count : 1;
+
+	pool.threads = threads;
+	pool.job = job;
+	pool.arg = arg;
+	pool.failed = 0;
+	pool.ranges = aligned_alloc(64, sizeof(struct pool_range) * threads);
+	workers = malloc(sizeof(struct pool_worker) * threads);
+	tids = malloc(sizeof(pthread_t) * threads);
+	if (!pool.ranges || !workers || !tids)
+	{
+		free(pool.ranges);
+		free(workers);
+		free(tids);
+		return -1;
+	}
+
+	for (i = 0; i < threads; i++)
+	{
+		pthread_mutex_init(&pool.ranges[i].lock, NULL);
+		pool.ranges[i].next = (uint64_t)count * i / threads;
+		pool.ranges[i].end = (uint64_t)count * (i + 1) / threads;
+		workers[i].pool = &pool;
+		workers[i].id = i;
+	}
+
+	// worker 0 is this thread
+	for (i = 1, started = 1; i < threads; i++, started++)
+		if (pthread_create(&tids[i], NULL, pool_thread, &workers[i]) != 0)
+			break;
+	pool_thread(&workers[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	// if some threads couldn't be started, their ranges got stolen by the rest
+
+	for (i = 0; i < threads; i++)
+		pthread_mutex_destroy(&pool.ranges[i].lock);
+	free(pool.ranges);
+	free(workers);
+	free(tids);
+
+	return pool.failed ? -1 : 0;
+}
+
+// ---------------------- worker pool end ----------------------
+
+// ---------------------- gathered output ----------------------
+
+// An entry goes out as a handful of small pieces (tar header, gz header, 
+// data, gz footer, padding), and writing them one at a time costs a syscall 
+// each. The pieces are collected here instead and written with one writev(),
+// and runs of small entries are put together the same way until there are 
+// GATHER_BYTES of them.
+#define GATHER_IOV 64
+#define GATHER_BYTES (256 * 1024)
+
+// File data up to this size is read into the arena, anything bigger is left 
+// for the kernel to copy (see fd_copy())
+#define GATHER_INLINE_MAX (32 * 1024)
+
+struct gather
+{
+	int fd;
+	off_t offset; // where the pieces go with pwritev(), or -1 for the file position
+	int (*send)(void *ctx, const void *buf, size_t len); // used instead of fd if set
+	void *ctx;
+	int count;
+	uint64_t bytes;
+	struct iovec iov[GATHER_IOV];
+	unsigned char *arena; // copies of the small pieces, kept until the next flush
+	size_t arena_size, arena_used;
+	struct zip_input *mapped; // mapped zip data to drop from memory after the next flush
+	off_t mapped_from, mapped_to;
+};
+
+// With an arena_size of 0 only memory that stays put is gathered (the mapped 
+// zip, the padding, the caller's own buffers), everything else is copied 
+// straight to fd.
+static int gather_init(struct gather *g, int fd, size_t arena_size)
+{
+	g->fd = fd;
+	g->offset = -1;
+	g->send = NULL;
+	g->ctx = NULL;
+	g->count = 0;
+	g->bytes = 0;
+	g->arena = NULL;
+	g->arena_size = arena_size;
+	g->arena_used = 0;
+	g->mapped = NULL;
+
+	if (arena_size > 0)
+		g->arena = malloc(arena_size);
+
+	return (arena_size > 0 && !g->arena) ? -1 : 0;
+}
+
+static void gather_free(struct gather *g)
+{
+	free(g->arena);
+}
+
+// Writes out everything gathered so far
+static int gather_flush(struct gather *g)
+{
+	struct iovec *iov = g->iov;
+	int count = g->count;
+	uint64_t t;
+	ssize_t n;
+
+	g->count = 0;
+	g->bytes = 0;
+	g->arena_used = 0;
+
+	for (; g->send && count > 0; iov++, count--)
+		if (g->send(g->ctx, iov->iov_base, iov->iov_len) == -1)
+			return -1;
+
+	while (count > 0)
+	{
+		t = stats_now();
+		if (g->offset == -1)
+			n = writev(g->fd, iov, count);
+		else
+			n = pwritev(g->fd, iov, count, g->offset);
+		stats_add(STAT_WRITE, t, n > 0 ? n : 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		if (g->offset != -1)
+			g->offset += n;
+
+		// a short write can stop in the middle of a piece
+		while (count > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0)
+		{
+			iov->iov_base = (unsigned char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	if (g->mapped)
+		zip_input_release(g->mapped, g->mapped_from, g->mapped_to - g->mapped_from);
+	g->mapped = NULL;
+
+	return 0;
+}
+
+// Flushes if another piece, needing arena_len bytes of the arena, won't fit
+static inline int gather_make_room(struct gather *g, size_t arena_len)
+{
+	if (g->count < GATHER_IOV && g->bytes < GATHER_BYTES && g->arena_used + arena_len <= g->arena_size)
+		return 0;
+
+	return gather_flush(g);
+}
+
+// Adds len bytes at p, which have to stay put until the next flush
+static int gather_add(struct gather *g, const void *p, size_t len)
+{
+	struct iovec *last;
+
+	if (len == 0)
+		return 0;
+
+	// a piece that carries on from the last one just makes it longer
+	last = g->count > 0 ? &g->iov[g->count - 1] : NULL;
+	if (last && (const unsigned char *)last->iov_base + last->iov_len == p)
+		last->iov_len += len;
+	else
+	{
+		if (gather_make_room(g, 0) == -1)
+			return -1;
+		g->iov[g->count].iov_base = (void *)p;
+		g->iov[g->count].iov_len = len;
+		g->count++;
+	}
+	g->bytes += len;
+
+	return 0;
+}
+
+// Returns room in the arena for len bytes, to be filled in by the caller 
+// before the next flush.
+static void *gather_alloc(struct gather *g, size_t len)
+{
+	unsigned char *p;
+
+	if (len > g->arena_size || gather_make_room(g, len) == -1)
+		return NULL;
+
+	// the room check above means this can't flush and hand p out again
+	p = g->arena + g->arena_used;
+	g->arena_used += len;
+	if (gather_add(g, p, len) == -1)
+		return NULL;
+
+	return p;
+}
+
+// Adds a copy of len bytes at p
+static int gather_copy(struct gather *g, const void *p, size_t len)
+{
+	void *dst;
+
+	if (len == 0)
+		return 0;
+	if (len > g->arena_size) // no arena, or it's too small: write what's there and this
+		return gather_add(g, p, len) == -1 ? -1 : gather_flush(g);
+
+	dst = gather_alloc(g, len);
+	if (!dst)
+		return -1;
+	memcpy(dst, p, len);
+
+	return 0;
+}
+
+// Adds len mapped bytes at p under a memory budget: they go out at most 
+// pipe_memory at a time and are dropped from memory once they have
+static int gather_window(struct gather *g, struct zip_source *src, const unsigned char *p, uint64_t len)
+{
+	size_t n;
+
+	for (; len > 0; len -= n, p += n)
+	{
+		n = len < pipe_memory ? len : pipe_memory;
+		if (g->mapped && g->mapped_to != src->offset && gather_flush(g) == -1)
+			return -1;
+		if (gather_add(g, p, n) == -1)
+			return -1;
+		if (!g->mapped)
+		{
+			g->mapped = src->zip;
+			g->mapped_from = src->offset;
+		}
+		src->offset += n;
+		g->mapped_to = src->offset;
+		if ((uint64_t)(g->mapped_to - g->mapped_from) >= pipe_memory && gather_flush(g) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+// Adds the next len bytes of file data from src. Mapped data is only pointed
+// at and small pieces are read into the arena. Anything else is copied by 
+// the kernel, after writing out everything before it.
+static int gather_source(struct gather *g, struct zip_source *src, uint64_t len)
+{
+	const unsigned char *p;
+	void *buf;
+
+	// an empty entry has nothing to add, and gather_alloc() can't tell
+	// zero bytes from a failure
+	if (len == 0)
+		return 0;
+
+	if (!src->stream && (p = zip_input_ptr(src->zip, src->offset, len)))
+	{
+		if (pipe_memory)
+			return gather_window(g, src, p, len);
+		src->offset += len;
+		return gather_add(g, p, len);
+	}
+
+	if (len <= GATHER_INLINE_MAX && len <= g->arena_size)
+	{
+		buf = gather_alloc(g, len);
+		if (!buf)
+			return -1;
+		if (src->stream)
+			return stream_read(src->stream, buf, len);
+		if (zip_input_read(src->zip, buf, len, src->offset) == -1)
+			return -1;
+		src->offset += len;
+		return 0;
+	}
+
+	if (gather_flush(g) == -1)
+		return -1;
+	if (g->send)
+		return source_send(src, g->send, g->ctx, len);
+	return source_copy(src, g->fd, g->offset == -1 ? NULL : &g->offset, len);
+}
+
+// Output that doesn't go to a file descriptor goes through a sink's write()
+struct bh_sink
+{
+	int fd; // -1 unless it's an fd sink
+	int (*write)(void *ctx, const void *buf, size_t len);
+	void *ctx;
+	unsigned char *data; // what a memory sink has been given
+	size_t len, capacity;
+};
+
+// Sets g up to write to sink
+static int gather_init_sink(struct gather *g, struct bh_sink *sink, size_t arena_size)
+{
+	if (gather_init(g, sink->fd, arena_size) == -1)
+		return -1;
+	if (sink->fd == -1)
+	{
+		g->send = sink->write;
+		g->ctx = sink->ctx;
+	}
+
+	return 0;
+}
+
+static int sink_memory_write(void *ctx, const void *buf, size_t len)
+{
+	struct bh_sink *sink = ctx;
+	unsigned char *data;
+	size_t capacity;
+
+	if (sink->len + len > sink->capacity)
+	{
+		for (capacity = sink->capacity ? sink->capacity : 65536; capacity < sink->len + len; capacity *= 2)
+			;
+		data = realloc(sink->data, capacity);
+		if (!data)
+			return -1;
+		sink->data = data;
+		sink->capacity = capacity;
+	}
+	memcpy(sink->data + sink->len, buf, len);
+	sink->len += len;
+
+	return 0;
+}
+
+static int sink_new(struct bh_sink **sink, int fd, int (*write)(void *ctx, const void *buf, size_t len), void *ctx)
+{
+	*sink = calloc(1, sizeof(struct bh_sink));
+	if (!*sink)
+		return BH_ERR_MEMORY;
+	(*sink)->fd = fd;
+	(*sink)->write = write;
+	(*sink)->ctx = ctx;
+
+	return BH_OK;
+}
+
+int bh_sink_fd(struct bh_sink **sink, int fd)
+{
+	if (fd < 0)
+		return BH_ERR_ARGUMENT;
+	return sink_new(sink, fd, NULL, NULL);
+}
+
+int bh_sink_memory(struct bh_sink **sink)
+{
+	int ret = sink_new(sink, -1, sink_memory_write, NULL);
+
+	if (ret == BH_OK)
+		(*sink)->ctx = *sink;
+	return ret;
+}
+
+int bh_sink_callback(struct bh_sink **sink, int (*write)(void *ctx, const void *buf, size_t len), void *ctx)
+{
+	if (!write)
+		return BH_ERR_ARGUMENT;
+	return sink_new(sink, -1, write, ctx);
+}
+
+const void *bh_sink_data(struct bh_sink *sink, size_t *len)
+{
+	*len = sink->len;
+	return sink->data;
+}
+
+void bh_sink_free(struct bh_sink *sink)
+{
+	if (!sink)
+		return;
+	free(sink->data);
+	free(sink);
+}
+
+// ---------------------- gathered output end ------------------
+
+// ---------------------- deflate scanning ----------------------
+
+// The only way to find where a deflate stream ends is to decode it: just the
+// last block says it's the last one, and nothing records how long the 
+// compressed blocks are. The codes are decoded the way puff.c from zlib's 
+// contrib does it, bit by bit, without producing any output. That's slow 
+// next to a real inflate, but small.
+// --verify=inflate needs the output after all, for its crc and size. Given 
+// a window the same decoding also inflates into it, and the output is 
+// crc'd and dropped as the window slides.
+
+#define DEFLATE_MAX_BITS 15
+#define DEFLATE_MAX_LCODES 286
+#define DEFLATE_MAX_DCODES 30
+#define DEFLATE_FIXED_LCODES 288
+
+// matches reach at most 32K back, the window holds twice that so it only 
+// has to slide every 32K
+#define DEFLATE_WINDOW (32 * 1024)
+#define DEFLATE_WINDOW_BUFFER (2 * DEFLATE_WINDOW)
+
+struct huffman
+{
+	short count[DEFLATE_MAX_BITS + 1]; // number of codes of each length
+	short symbol[DEFLATE_FIXED_LCODES]; // symbols, ordered by their codes
+};
+
+// A deflate stream being read from st. Every byte of it is passed on to out,
+// unless out is NULL. If window isn't NULL it's inflated as well.
+struct deflate_scan
+{
+	struct zip_stream *st;
+	struct gather *out;
+	size_t start; // first byte in the stream buffer that hasn't been passed on
+	uint64_t len; // bytes of the deflate stream read so far
+	uint32_t bitbuf;
+	int bitcnt;
+	unsigned char *window; // DEFLATE_WINDOW_BUFFER bytes
+	size_t have;     // bytes in the window
+	size_t checked;  // bytes at the start of the window that are in crc
+	uint32_t crc;
+	uint64_t inflated;
+	int splice; // clear the last block's final bit on the way through
+};
+
+// Passes on what has been read from the stream buffer and refills it
+static int scan_refill(struct deflate_scan *s)
+{
+	struct zip_stream *st = s->st;
+
+	if (s->out && gather_copy(s->out, st->buffer + s->start, st->pos - s->start) == -1)
+		return -1;
+	if (stream_fill(st, 1) == 0)
+		return -1;
+	s->start = st->pos;
+
+	return 0;
+}
+
+static inline int scan_byte(struct deflate_scan *s)
+{
+	struct zip_stream *st = s->st;
+
+	if (st->pos == st->len && scan_refill(s) == -1)
+		return -1;
+	s->len++;
+
+	return st->buffer[st->pos++];
+}
+
+// Returns the next need bits (at most 16), or -1 if the stream ends first
+static int scan_bits(struct deflate_scan *s, int need)
+{
+	uint32_t val = s->bitbuf;
+	int c;
+
+	while (s->bitcnt < need)
+	{
+		c = scan_byte(s);
+		if (c == -1)
+			return -1;
+		val |= (uint32_t)c << s->bitcnt;
+		s->bitcnt += 8;
+	}
+	s->bitbuf = val >> need;
+	s->bitcnt -= need;
+
+	return val & ((1U << need) - 1);
+}
+
+// Adds what's new in the window to the crc, and when the window is full 
+// keeps only the last DEFLATE_WINDOW bytes
+static void scan_slide(struct deflate_scan *s)
+{
+	s->crc = update_crc(s->crc, s->window + s->checked, s->have - s->checked);
+	s->checked = s->have;
+	if (s->have < DEFLATE_WINDOW_BUFFER)
+		return;
+
+	memmove(s->window, s->window + s->have - DEFLATE_WINDOW, DEFLATE_WINDOW);
+	s->have = s->checked = DEFLATE_WINDOW;
+}
+
+// Inflates len literal bytes
+static void scan_put(struct deflate_scan *s, const unsigned char *p, size_t len)
+{
+	size_t n;
+
+	s->inflated += len;
+	while (len > 0)
+	{
+		if (s->have == DEFLATE_WINDOW_BUFFER)
+			scan_slide(s);
+		n = DEFLATE_WINDOW_BUFFER - s->have;
+		if (n > len)
+			n = len;
+		memcpy(s->window + s->have, p, n);
+		s->have += n;
+		p += n;
+		len -= n;
+	}
+}
+
+// Inflates a match of len bytes from dist bytes back. They can overlap.
+static int scan_match(struct deflate_scan *s, int dist, int len)
+{
+	if ((size_t)dist > s->have)
+		return -1;
+
+	s->inflated += len;
+	while (len-- > 0)
+	{
+		if (s->have == DEFLATE_WINDOW_BUFFER)
+			scan_slide(s);
+		s->window[s->have] = s->window[s->have - dist];
+		s->have++;
+	}
+
+	return 0;
+}
+
+static int scan_stored(struct deflate_scan *s)
+{
+	struct zip_stream *st = s->st;
+	uint32_t header = 0;
+	size_t n, len;
+	int i, c;
+
+	// the rest of the byte with the block header in it is padding
+	s->bitbuf = 0;
+	s->bitcnt = 0;
+
+	for (i = 0; i < 4; i++)
+	{
+		c = scan_byte(s);
+		if (c == -1)
+			return -1;
+		header |= (uint32_t)c << (8 * i);
+	}
+	len = header & 0xffff;
+	if (len != (~header >> 16))
+		return -1;
+
+	while (len > 0)
+	{
+		if (st->pos == st->len && scan_refill(s) == -1)
+			return -1;
+		n = st->len - st->pos;
+		if (n > len)
+			n = len;
+		if (s->window)
+			scan_put(s, st->buffer + st->pos, n);
+		st->pos += n;
+		s->len += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Returns the next symbol in code h, or -1
+static int scan_decode(struct deflate_scan *s, const struct huffman *h)
+{
+	int code = 0, first = 0, index = 0, len, count, c;
+
+	for (len = 1; len <= DEFLATE_MAX_BITS; len++)
+	{
+		if (s->bitcnt == 0)
+		{
+			c = scan_byte(s);
+			if (c == -1)
+				return -1;
+			s->bitbuf = c;
+			s->bitcnt = 8;
+		}
+		code |= s->bitbuf & 1;
+		s->bitbuf >>= 1;
+		s->bitcnt--;
+
+		count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+
+	return -1; // ran out of codes
+}
+
+// Builds the code for n symbols with the code lengths in length. Returns 0 
+// if the code is complete, more than 0 if it's incomplete and less than 0 
+// if it has too many codes.
+static int huffman_build(struct huffman *h, const short *length, int n)
+{
+	short offs[DEFLATE_MAX_BITS + 1];
+	int symbol, len, left;
+
+	for (len = 0; len <= DEFLATE_MAX_BITS; len++)
+		h->count[len] = 0;
+	for (symbol = 0; symbol < n; symbol++)
+		h->count[length[symbol]]++;
+	if (h->count[0] == n) // no codes at all
+		return 0;
+
+	left = 1;
+	for (len = 1; len <= DEFLATE_MAX_BITS; len++)
+	{
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0)
+			return left;
+	}
+
+	offs[1] = 0;
+	for (len = 1; len < DEFLATE_MAX_BITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (symbol = 0; symbol < n; symbol++)
+		if (length[symbol] != 0)
+			h->symbol[offs[length[symbol]]++] = symbol;
+
+	return left;
+}
+
+// Decodes the codes of a compressed block, up to its end of block code. 
+// Without a window only the number of extra bits matters, the lengths and 
+// distances are only worked out for inflating.
+static int scan_codes(struct deflate_scan *s, const struct huffman *lencode, const struct huffman *distcode)
+{
+	static const short len_base[29] = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const unsigned char len_extra[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	static const short dist_base[30] = {
+		1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+		1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+	static const unsigned char dist_extra[30] = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+	unsigned char literal;
+	int symbol, len, dist;
+
+	for (;;)
+	{
+		symbol = scan_decode(s, lencode);
+		if (symbol < 0)
+			return -1;
+		if (symbol < 256) // a literal
+		{
+			literal = symbol;
+			if (s->window)
+				scan_put(s, &literal, 1);
+			continue;
+		}
+		if (symbol == 256) // end of block
+			return 0;
+
+		symbol -= 257;
+		if (symbol >= 29 || (len = scan_bits(s, len_extra[symbol])) == -1)
+			return -1;
+		len += len_base[symbol];
+		symbol = scan_decode(s, distcode);
+		if (symbol < 0 || symbol >= 30 || (dist = scan_bits(s, dist_extra[symbol])) == -1)
+			return -1;
+		dist += dist_base[symbol];
+		if (s->window && scan_match(s, dist, len) == -1)
+			return -1;
+	}
+}
+
+static int scan_fixed(struct deflate_scan *s)
+{
+	short lengths[DEFLATE_FIXED_LCODES];
+	struct huffman lencode, distcode;
+	int symbol;
+
+	for (symbol = 0; symbol < 144; symbol++)
+		lengths[symbol] = 8;
+	for (; symbol < 256; symbol++)
+		lengths[symbol] = 9;
+	for (; symbol < 280; symbol++)
+		lengths[symbol] = 7;
+	for (; symbol < DEFLATE_FIXED_LCODES; symbol++)
+		lengths[symbol] = 8;
+	huffman_build(&lencode, lengths, DEFLATE_FIXED_LCODES);
+
+	for (symbol = 0; symbol < DEFLATE_MAX_DCODES; symbol++)
+		lengths[symbol] = 5;
+	huffman_build(&distcode, lengths, DEFLATE_MAX_DCODES);
+
+	return scan_codes(s, &lencode, &distcode);
+}
+
+static int scan_dynamic(struct deflate_scan *s)
+{
+	static const short order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+	short lengths[DEFLATE_MAX_LCODES + DEFLATE_MAX_DCODES];
+	struct huffman lencode, distcode;
+	int nlen, ndist, ncode, index, symbol, len, err;
+
+	nlen = scan_bits(s, 5);
+	ndist = scan_bits(s, 5);
+	ncode = scan_bits(s, 4);
+	if (nlen == -1 || ndist == -1 || ncode == -1)
+		return -1;
+	nlen += 257;
+	ndist += 1;
+	ncode += 4;
+	if (nlen > DEFLATE_MAX_LCODES || ndist > DEFLATE_MAX_DCODES)
+		return -1;
+
+	// the code lengths are themselves sent with a code
+	for (index = 0; index < ncode; index++)
+	{
+		len = scan_bits(s, 3);
+		if (len == -1)
+			return -1;
+		lengths[order[index]] = len;
+	}
+	for (; index < 19; index++)
+		lengths[order[index]] = 0;
+	if (huffman_build(&lencode, lengths, 19) != 0)
+		return -1;
+
+	for (index = 0; index < nlen + ndist;)
+	{
+		symbol = scan_decode(s, &lencode);
+		if (symbol < 0)
+			return -1;
+		if (symbol < 16)
+		{
+			lengths[index++] = symbol;
+			continue;
+		}
+
+		// repeats: the last length, or zeros
+		len = 0;
+		if (symbol == 16)
+		{
+			if (index == 0)
+				return -1;
+			len = lengths[index - 1];
+			symbol = scan_bits(s, 2);
+			symbol = symbol == -1 ? -1 : symbol + 3;
+		}
+		else if (symbol == 17)
+		{
+			symbol = scan_bits(s, 3);
+			symbol = symbol == -1 ? -1 : symbol + 3;
+		}
+		else
+		{
+			symbol = scan_bits(s, 7);
+			symbol = symbol == -1 ? -1 : symbol + 11;
+		}
+		if (symbol == -1 || index + symbol > nlen + ndist)
+			return -1;
+		while (symbol--)
+			lengths[index++] = len;
+	}
+
+	// a block without an end of block code can't end
+	if (lengths[256] == 0)
+		return -1;
+
+	// incomplete codes are only allowed when there's just one code
+	err = huffman_build(&lencode, lengths, nlen);
+	if (err < 0 || (err > 0 && nlen - lencode.count[0] != 1))
+		return -1;
+	err = huffman_build(&distcode, lengths + nlen, ndist);
+	if (err < 0 || (err > 0 && ndist - distcode.count[0] != 1))
+		return -1;
+
+	return scan_codes(s, &lencode, &distcode);
+}
+
+// Reads one whole deflate stream from st, passing it on to out (if out isn't
+// NULL), and puts its length in bytes in len. The stream ends on a byte 
+// boundary, whatever bits are left in its last byte are padding. Returns -1 
+// if the stream is damaged or ends early.
+static int scan_blocks(struct deflate_scan *s)
+{
+	int last, type, ret;
+
+	do
+	{
+		// the bit just read is in the last byte read, which hasn't been 
+		// passed on yet
+		last = scan_bits(s, 1);
+		if (last == 1 && s->splice)
+			s->st->buffer[s->st->pos - 1] &= ~(1 << (7 - s->bitcnt));
+		type = scan_bits(s, 2);
+		if (last == -1 || type == -1)
+			return -1;
+
+		switch (type)
+		{
+			case 0:
+				ret = scan_stored(s);
+				break;
+			case 1:
+				ret = scan_fixed(s);
+				break;
+			case 2:
+				ret = scan_dynamic(s);
+				break;
+			default:
+				ret = -1;
+				break;
+		}
+		if (ret == -1)
+			return -1;
+	} while (!last);
+
+	return 0;
+}
+
+static int deflate_scan(struct zip_stream *st, struct gather *out, uint64_t *len)
+{
+	struct deflate_scan s = {st, out, st->pos, 0, 0, 0, NULL, 0, 0, 0, 0, 0};
+
+	if (scan_blocks(&s) == -1)
+		return -1;
+	if (out && gather_copy(out, st->buffer + s.start, st->pos - s.start) == -1)
+		return -1;
+	*len = s.len;
+
+	return 0;
+}
+
+// Like deflate_scan(), but the stream is passed on so that more deflate 
+// blocks can follow it: its last block isn't marked final, and it ends on a 
+// byte boundary. Where the last block stops short of one, the bits left in 
+// its last byte are cleared and an empty stored block starts there, since a
+// stored block's header is padded out to the next byte. Its three bits of 
+// header don't always fit, then the padding takes up a byte more.
+static int deflate_splice(struct zip_stream *st, struct gather *out, uint64_t *len)
+{
+	static const unsigned char empty[5] = {0, 0, 0, 0xff, 0xff};
+	struct deflate_scan s = {st, out, st->pos, 0, 0, 0, NULL, 0, 0, 0, 0, 1};
+
+	if (scan_blocks(&s) == -1)
+		return -1;
+	if (s.bitcnt)
+		st->buffer[st->pos - 1] &= (1 << (8 - s.bitcnt)) - 1;
+	if (gather_copy(out, st->buffer + s.start, st->pos - s.start) == -1)
+		return -1;
+	*len = s.len;
+
+	if (s.bitcnt == 0)
+		return 0;
+	return s.bitcnt >= 3 ? gather_copy(out, empty + 1, 4) : gather_copy(out, empty, 5);
+}
+
+#ifndef BH_ZLIB
+// Inflates one whole deflate stream from st into window (of 
+// DEFLATE_WINDOW_BUFFER bytes), keeping only the crc and size of what came 
+// out. len gets the length of the deflate stream itself. With zlib, 
+// verify_inflate() uses its inflate() instead.
+static int deflate_inflate(struct zip_stream *st, unsigned char *window, uint64_t *len, uint32_t *crc, uint64_t *size)
+{
+	struct deflate_scan s = {st, NULL, st->pos, 0, 0, 0, window, 0, 0, 0, 0, 0};
+
+	if (scan_blocks(&s) == -1)
+		return -1;
+	scan_slide(&s);
+	*len = s.len;
+	*crc = s.crc;
+	*size = s.inflated;
+
+	return 0;
+}
+#endif
+
+// ---------------------- deflate scanning end -----------------
+
+// ---------------------- compression ----------------------
+
+// Stored entries can be deflated on the way through, pigz style: the data 
+// is cut into COMPRESS_BLOCK blocks that are compressed on all the threads 
+// at once, each with the 32K before it as its dictionary so that matches 
+// reach back across the cut. Every block but the last ends with a sync 
+// flush, which leaves it on a byte boundary, so they join up into one 
+// deflate stream. The crc is the zip's, nothing needs working out again.
+// A round is one block per thread, so memory use doesn't depend on the 
+// size of the entry.
+#define COMPRESS_BLOCK (128 * 1024)
+#define COMPRESS_DICT 32768
+#define COMPRESS_OUT (COMPRESS_BLOCK + COMPRESS_BLOCK / 8 + 64) // more than deflate can grow a block
+
+static int compress_level = 0; // 0 leaves stored entries as they are
+
+// Whether the stored entry is going to be compressed
+static inline int compress_entry(struct zip_entry *entry)
+{
+	return compress_level && entry->compression == ZIP_ALG_STORE && entry->zip_size > 0;
+}
+
+#ifdef BH_ZLIB
+#include <zlib.h>
+
+static int compress_threads = 1;
+
+// One round of blocks. in has dict bytes of the data before it in front.
+struct compress_job
+{
+	const unsigned char *in;
+	size_t dict;
+	size_t len;
+	int last; // the round ends the entry
+	int final; // and its last block ends the deflate stream
+	unsigned char *out; // COMPRESS_OUT for each block
+	size_t out_len[];
+};
+
+static int compress_block(void *arg, uint32_t index, int worker)
+{
+	struct compress_job *job = arg;
+	const unsigned char *in = job->in + (size_t)index * COMPRESS_BLOCK;
+	size_t len = job->len - (size_t)index * COMPRESS_BLOCK;
+	size_t dict = index ? COMPRESS_DICT : job->dict;
+	int final, ret;
+	z_stream z = {0};
+	uint64_t t = stats_now();
+
+	(void)worker;
+	if (len > COMPRESS_BLOCK)
+		len = COMPRESS_BLOCK;
+	final = job->final && job->last && (size_t)index * COMPRESS_BLOCK + len == job->len;
+
+	if (deflateInit2(&z, compress_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+	if (dict)
+		deflateSetDictionary(&z, in - dict, dict);
+	z.next_in = (unsigned char *)in;
+	z.avail_in = len;
+	z.next_out = job->out + (size_t)index * COMPRESS_OUT;
+	z.avail_out = COMPRESS_OUT;
+	ret = deflate(&z, final ? Z_FINISH : Z_SYNC_FLUSH);
+	job->out_len[index] = COMPRESS_OUT - z.avail_out;
+	deflateEnd(&z);
+	stats_add(STAT_DEFLATE, t, len);
+
+	// a sync flush that filled the buffer might not be finished
+	return (final ? ret == Z_STREAM_END : ret == Z_OK && z.avail_out > 0) ? 0 : -1;
+}
+
+// Adds the next len bytes of stored data from src as one deflate stream. 
+// Unless final is set its last block is sync flushed too, so that more can 
+// follow it.
+static int gather_compress(struct gather *g, struct zip_source *src, uint64_t len, int final)
+{
+	struct compress_job *job;
+	const unsigned char *map;
+	unsigned char *buffer = NULL;
+	uint32_t blocks, i;
+	size_t round = (size_t)COMPRESS_BLOCK * compress_threads, dict = 0;
+	int ret = -1;
+
+	if (round > len)
+		round = len;
+	blocks = (round + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+	job = malloc(sizeof(struct compress_job) + sizeof(size_t) * blocks);
+	if (!job)
+		return -1;
+	job->out = malloc((size_t)COMPRESS_OUT * blocks);
+
+	// a mapped entry is compressed where it is, anything else is read into 
+	// buffer after the last 32K of the round before
+	map = src->stream ? NULL : zip_input_ptr(src->zip, src->offset, len);
+	if (!map)
+		buffer = malloc(COMPRESS_DICT + round);
+	if (!job->out || (!map && !buffer))
+		goto done;
+
+	while (len > 0)
+	{
+		job->len = len < round ? len : round;
+		job->last = job->len == len;
+		job->final = final;
+		if (map)
+		{
+			job->in = map;
+			job->dict = dict;
+			map += job->len;
+		}
+		else
+		{
+			job->in = buffer + COMPRESS_DICT;
+			job->dict = dict;
+			if (src->stream ? stream_read(src->stream, buffer + COMPRESS_DICT, job->len) == -1 :
+				zip_input_read(src->zip, buffer + COMPRESS_DICT, job->len, src->offset) == -1)
+				goto done;
+		}
+		if (!src->stream)
+			src->offset += job->len;
+
+		blocks = (job->len + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+		if (pool_run(compress_threads, blocks, compress_block, job) == -1)
+			goto done;
+		for (i = 0; i < blocks; i++)
+			if (gather_add(g, job->out + (size_t)i * COMPRESS_OUT, job->out_len[i]) == -1)
+				goto done;
+		// the blocks are written over in the next round
+		if (gather_flush(g) == -1)
+			goto done;
+
+		dict = job->len < COMPRESS_DICT ? job->len : COMPRESS_DICT;
+		if (!map)
+			memmove(buffer + COMPRESS_DICT - dict, buffer + COMPRESS_DICT + job->len - dict, dict);
+		len -= job->len;
+	}
+	ret = 0;
+
+done:
+	free(buffer);
+	free(job->out);
+	free(job);
+	return ret;
+}
+#else
+static int gather_compress(struct gather *g, struct zip_source *src, uint64_t len, int final)
+{
+	(void)g;
+	(void)src;
+	(void)len;
+	(void)final;
+	return -1;
+}
+#endif
+
+int bh_compress(int level, int threads)
+{
+#ifdef BH_ZLIB
+	if (level < 0 || level > 9)
+		return BH_ERR_ARGUMENT;
+	compress_level = level;
+	compress_threads = threads > 1 ? threads : 1;
+	return BH_OK;
+#else
+	(void)threads;
+	return level == 0 ? BH_OK : BH_ERR_ARGUMENT;
+#endif
+}
+
+// ---------------------- compression end ------------------
+
+// Writes one entry of a plain tarball, or just its header if link isn't NULL:
+// a hard link to the entry called link, which has the same data.
+static int tar_write(unsigned char *fname, struct zip_source *src, struct gather *out, struct zip_entry *dir_entry, const unsigned char *link)
+{
+	struct tar_posix_header tar_header = {0};
+	struct gz_header header = {0};
+	struct gz_footer footer = {0};
+	unsigned char long_name[1024];
+	uint64_t pad_bytes;
+	uint32_t len;
+
+	len = tar_long_name(long_name, fname);
+	if (len && gather_copy(out, long_name, len) == -1)
+		return -1;
+
+	if (link)
+	{
+		tar_header_fill(&tar_header, fname, 0);
+		tar_header_link(&tar_header, link);
+		return gather_copy(out, &tar_header, sizeof(struct tar_posix_header));
+	}
+
+	// tar headers
+	tar_header_fill(&tar_header, fname, tar_entry_size(dir_entry->zip_size, dir_entry->compression == ZIP_ALG_DEFLATE));
+
+	// gz headers
+	header.magic = GZ_MAGIC;
+	header.method = GZ_METHOD_DEFLATE;
+	header.flags = 0;
+	header.os = GZ_OS_LINUX;
+
+	footer.crc = dir_entry->crc32;
+	footer.isize = dir_entry->unzip_size;
+
+	// the file data gets copied straight from the zip into the tarball
+	if (gather_copy(out, &tar_header, sizeof(struct tar_posix_header)) == -1)
+		return -1;
+	if (dir_entry->compression == ZIP_ALG_DEFLATE)
+	{
+		if (gather_copy(out, &header, sizeof(struct gz_header)) == -1 ||
+			gather_source(out, src, dir_entry->zip_size) == -1 ||
+			gather_copy(out, &footer, sizeof(struct gz_footer)) == -1)
+			return -1;
+	}
+	else if (dir_entry->compression == ZIP_ALG_STORE)
+	{
+		if (gather_source(out, src, dir_entry->zip_size) == -1)
+			return -1;
+	}
+
+	// entries that already end on a block boundary don't get a block of padding
+	pad_bytes = (512 - (tar_entry_size(dir_entry->zip_size, dir_entry->compression == ZIP_ALG_DEFLATE) % 512)) % 512;
+
+	return gather_add(out, padding, pad_bytes);
+}
+
+// Where a gzipped tarball is up to between entries
+struct tgz_state
+{
+	uint32_t pad_bytes; // the padding owed by the last entry
+	int single;  // everything goes in one gzip member (BH_MODE_MAKE_TGZ_SINGLE)
+	int started; // and its gzip header is out
+	uint32_t crc; // of the member so far
+	uint32_t size; // modulo 4 GiB, like gzip keeps it
+	struct zip_stream scan; // for reading deflate streams out of a zip, see tgz_splice()
+};
+
+static void tgz_init(struct tgz_state *tgz, int mode)
+{
+	memset(tgz, 0, sizeof(struct tgz_state));
+	tgz->single = mode == BH_MODE_MAKE_TGZ_SINGLE;
+}
+
+static void tgz_free(struct tgz_state *tgz)
+{
+	free(tgz->scan.buffer);
+}
+
+// Splices the deflate stream of an entry into a single member, see 
+// deflate_splice(). Only decoding it tells where its last block starts, so 
+// unless the zip is being streamed it's read through a stream of its own.
+static int tgz_splice(struct tgz_state *tgz, struct zip_source *src, struct gather *out, struct zip_entry *dir_entry)
+{
+	struct zip_stream *st = src->stream;
+	uint64_t len;
+
+	if (!st)
+	{
+		if (!tgz->scan.buffer && stream_open(&tgz->scan, -1) == -1)
+			return -1;
+		st = &tgz->scan;
+		stream_range(st, src->zip->fd, src->offset, dir_entry->zip_size);
+	}
+	if (deflate_splice(st, out, &len) == -1 || len > dir_entry->zip_size)
+		return -1;
+
+	// anything a streamed zip has after the deflate stream is dropped
+	return src->stream ? stream_skip(st, dir_entry->zip_size - len) : 0;
+}
+
+// Writes one entry of a gzipped tarball as a gzip member of its own. The 
+// member starts with a stored deflate block holding the padding left over 
+// from the previous entry followed by this entry's tar header. Then comes 
+// the file data: the deflate stream from the zip as it is, or stored data cut
+// into stored blocks. The member CRC is put together from the CRCs of the 
+// pieces with crc_combine(), so nothing is ever decompressed.
+// With tgz->single the same blocks go into one member for the whole 
+// tarball instead, with none of them final until tgz_finish(), and its CRC 
+// is carried from one entry to the next. tgz also carries the padding owed 
+// by the previous entry in, and the padding owed by this one out.
+// A hard link to the entry called link (see tar_write()) has no data, only 
+// an empty stored block after its header.
+static int tgz_write(unsigned char *fname, struct zip_source *src, struct gather *out, struct zip_entry *dir_entry, const unsigned char *link, struct tgz_state *tgz)
+{
+	unsigned char block[2048] = {0}; // padding + long name record + tar header
+	struct tar_posix_header *tar_header;
+	struct deflate_store_header store_header = {0};
+	struct gz_header header = {0};
+	struct gz_footer footer = {0};
+	uint32_t block_len = tgz->pad_bytes;
+	uint64_t size = link ? 0 : dir_entry->unzip_size, left, len;
+	int final = !tgz->single;
+
+	if (dir_entry->compression != ZIP_ALG_DEFLATE && dir_entry->compression != ZIP_ALG_STORE)
+		return -1;
+
+	// tar headers
+	block_len += tar_long_name(block + block_len, fname);
+	tar_header = (struct tar_posix_header *)(block + block_len);
+	block_len += sizeof(struct tar_posix_header);
+	tar_header_fill(tar_header, fname, size);
+	if (link)
+		tar_header_link(tar_header, link);
+
+	// gz headers
+	header.magic = GZ_MAGIC;
+	header.method = GZ_METHOD_DEFLATE;
+	header.flags = 0;
+	header.os = GZ_OS_LINUX;
+
+	footer.crc = crc_combine(crc(block, block_len), link ? 0 : dir_entry->crc32, size);
+	footer.isize = block_len + size;
+
+	store_header.method = DEFLATE_STORED;
+	store_header.block_size = block_len;
+	store_header.inverse_size = ~store_header.block_size;
+	if ((!tgz->started && gather_copy(out, &header, sizeof(struct gz_header)) == -1) ||
+		gather_copy(out, &store_header, sizeof(struct deflate_store_header)) == -1 ||
+		gather_copy(out, block, block_len) == -1)
+		return -1;
+	tgz->started = tgz->single;
+
+	if (!link && dir_entry->compression == ZIP_ALG_DEFLATE)
+	{
+		if ((final ? gather_source(out, src, dir_entry->zip_size) : tgz_splice(tgz, src, out, dir_entry)) == -1)
+			return -1;
+	}
+	else if (!link && compress_entry(dir_entry))
+	{
+		if (gather_compress(out, src, dir_entry->zip_size, final) == -1)
+			return -1;
+	}
+	else
+	{
+		// stored data goes in as stored blocks, the last one marked final.
+		// An empty file still needs its (empty) final block.
+		left = link ? 0 : dir_entry->zip_size;
+		do
+		{
+			len = left < DEFLATE_STORED_MAX ? left : DEFLATE_STORED_MAX;
+			store_header.method = DEFLATE_STORED | (final && len == left ? DEFLATE_FINAL : 0);
+			store_header.block_size = len;
+			store_header.inverse_size = ~store_header.block_size;
+			if (gather_copy(out, &store_header, sizeof(struct deflate_store_header)) == -1 ||
+				gather_source(out, src, len) == -1)
+				return -1;
+			left -= len;
+		} while (left > 0);
+	}
+
+	tgz->pad_bytes = (512 - (size % 512)) % 512;
+
+	if (tgz->single)
+	{
+		tgz->crc = crc_combine(tgz->crc, footer.crc, (uint64_t)block_len + size);
+		tgz->size += footer.isize;
+		return 0;
+	}
+	return gather_copy(out, &footer, sizeof(struct gz_footer));
+}
+
+// Ends a gzipped tarball with one last member, holding the padding of the 
+// last entry and the two zero blocks that mark the end of a tar archive. A 
+// single member gets them as its final block instead, and its footer.
+static int tgz_finish(struct gather *out, struct tgz_state *tgz)
+{
+	struct deflate_store_header store_header = {0};
+	struct gz_header header = {0};
+	struct gz_footer footer = {0};
+	uint32_t pad_bytes = tgz->pad_bytes, len = pad_bytes + 1024;
+
+	header.magic = GZ_MAGIC;
+	header.method = GZ_METHOD_DEFLATE;
+	header.flags = 0;
+	header.os = GZ_OS_LINUX;
+
+	store_header.method = DEFLATE_STORED | DEFLATE_FINAL;
+	store_header.block_size = len;
+	store_header.inverse_size = ~store_header.block_size;
+
+	footer.crc = update_crc(update_crc(update_crc(0, padding, pad_bytes), padding, 512), padding, 512);
+	footer.isize = len;
+	if (tgz->single)
+	{
+		footer.crc = crc_combine(tgz->crc, footer.crc, len);
+		footer.isize += tgz->size;
+	}
+
+	if ((!tgz->started && gather_copy(out, &header, sizeof(struct gz_header)) == -1) ||
+		gather_copy(out, &store_header, sizeof(struct deflate_store_header)) == -1 ||
+		gather_add(out, padding, pad_bytes) == -1 ||
+		gather_add(out, padding, 512) == -1 ||
+		gather_add(out, padding, 512) == -1 ||
+		gather_copy(out, &footer, sizeof(struct gz_footer)) == -1)
+		return -1;
+
+	return gather_flush(out);
+}
+
+// Writes the gzip file of an entry: a header, its deflate stream and a footer
+// from the central directory
+static int gz_write(struct zip_source *src, struct gather *out, struct zip_entry *dir_entry)
+{
+	struct gz_header header = {0};
+	struct gz_footer footer = {0};
+	int gz, ret;
+
+	header.magic = GZ_MAGIC;
+	header.method = GZ_METHOD_DEFLATE;
+	header.flags = 0;
+	header.os = GZ_OS_LINUX;
+
+	footer.crc = dir_entry->crc32;
+	footer.isize = dir_entry->unzip_size;
+
+	// stored files are extracted as they are, under their own name, unless
+	// they're being compressed
+	gz = dir_entry->compression == ZIP_ALG_DEFLATE || compress_entry(dir_entry);
+	ret = 0;
+	if (gz)
+		ret = gather_add(out, &header, sizeof(struct gz_header));
+	if (ret == 0 && dir_entry->compression == ZIP_ALG_DEFLATE)
+		ret = gather_source(out, src, dir_entry->zip_size);
+	else if (ret == 0)
+		ret = gz ? gather_compress(out, src, dir_entry->zip_size, 1) : gather_source(out, src, dir_entry->zip_size);
+	if (ret == 0 && gz)
+		ret = gather_add(out, &footer, 8);
+	if (ret == 0)
+		ret = gather_flush(out);
+
+	return ret;
+}
+
+// Extracts an entry into a gzip file of its own called fname
+// Makes every directory fname is in, like mkdir -p. Zips don't have to have
+// entries for their directories, and the ones they have can be extracted
+// after (or on another thread than) the files in them.
+static int make_parents(unsigned char *fname)
+{
+	unsigned char *p;
+	int ret;
+
+	for (p = fname + 1; *p; p++)
+	{
+		if (*p != '/')
+			continue;
+		*p = 0;
+		ret = mkdir((char *)fname, 0755);
+		*p = '/';
+		if (ret == -1 && errno != EEXIST)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int gz_create(unsigned char *fname, struct zip_source *src, struct zip_entry *dir_entry)
+{
+	struct gather out;
+	uint64_t t;
+	size_t len = strlen((char *)fname);
+	int gz_fd, ret;
+
+	// a directory entry is made into the directory, and the ones it's in
+	if (len > 0 && fname[len - 1] == '/')
+		return make_parents(fname);
+
+	t = stats_now();
+	gz_fd = open((char *)fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (gz_fd == -1 && errno == ENOENT && make_parents(fname) == 0)
+		gz_fd = open((char *)fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	stats_add(STAT_OPEN, t, 0);
+	if (gz_fd == -1)
+		return -1;
+
+	// no arena: header and footer stay on the stack, so a mapped entry is a 
+	// single writev() and anything else is header, copy, footer.
+	gather_init(&out, gz_fd, 0);
+	ret = gz_write(src, &out, dir_entry);
+
+	t = stats_now();
+	close(gz_fd);
+	stats_add(STAT_OPEN, t, 0);
+
+	return ret;
+}
+
+// The eocd is 22 bytes followed by a comment of at most 65535 bytes
+#define ZIP_EOCD_SEARCH (22 + 65535)
+
+// Locates the End of Central Directory header and returns its offset, or -1.
+// The tail of the file that could hold it is read in one go, then searched 
+// backwards for the signature with memrchr(), so a long comment costs one 
+// read instead of a syscall per byte.
+static off_t zip_locate_eocd(struct zip_input *zip, struct zip_eocd *zip_footer)
+{
+	unsigned char *buffer = NULL;
+	const unsigned char *tail, *p;
+	size_t tail_len, len;
+	off_t tail_offset, found = -1;
+	uint32_t magic = ZIP_EOCD_MAGIC;
+
+	if (zip->size < 22)
+		return -1;
+
+	tail_len = zip->size < ZIP_EOCD_SEARCH ? zip->size : ZIP_EOCD_SEARCH;
+	tail_offset = zip->size - tail_len;
+
+	tail = zip_input_ptr(zip, tail_offset, tail_len);
+	if (!tail)
+	{
+		buffer = malloc(tail_len);
+		if (!buffer || zip_input_read(zip, buffer, tail_len, tail_offset) == -1)
+		{
+			free(buffer);
+			return -1;
+		}
+		tail = buffer;
+	}
+
+	// the first byte of the signature is 'P', the eocd can't start in the last 21 bytes
+	len = tail_len - 21;
+	while ((p = memrchr(tail, ZIP_EOCD_MAGIC & 0xff, len)))
+	{
+		len = p - tail;
+		if (memcmp(p, &magic, 4) != 0)
+			continue;
+
+		memcpy(zip_footer, p, 22);
+		if (validate_eocd(zip_footer, tail_len - len - 22, tail_offset + len))
+		{
+			found = tail_offset + len;
+			break;
+		}
+	}
+
+	free(buffer);
+	return found;
+}
+
+// Fills cd with where the central directory is and how many records it has.
+// ZIP64 archives have a locator right before the eocd that points at a ZIP64
+// eocd with the real values, otherwise the eocd's own fields are widened.
+// Returns -1 if the eocd says it needs ZIP64 and there isn't a ZIP64 eocd.
+static int zip_read_zip64_eocd(struct zip_input *zip, off_t eocd_offset, struct zip_eocd *zip_footer, struct zip64_eocd *cd)
+{
+	struct zip64_eocd_locator locator;
+
+	memset(cd, 0, sizeof(struct zip64_eocd));
+	cd->central_records = zip_footer->central_records;
+	cd->total_central_records = zip_footer->total_central_records;
+	cd->central_dir_size = zip_footer->central_dir_size;
+	cd->central_dir_offset = zip_footer->central_dir_offset;
+
+	if (eocd_offset < (off_t)sizeof(struct zip64_eocd_locator) ||
+		zip_input_read(zip, &locator, sizeof(struct zip64_eocd_locator), eocd_offset - sizeof(struct zip64_eocd_locator)) == -1 ||
+		locator.magic != ZIP64_LOCATOR_MAGIC)
+	{
+		if (zip_footer->total_central_records == 0xFFFF ||
+			zip_footer->central_dir_size == ZIP64_SENTINEL ||
+			zip_footer->central_dir_offset == ZIP64_SENTINEL)
+			return -1;
+		return 0;
+	}
+
+	if (zip_input_read(zip, cd, sizeof(struct zip64_eocd), locator.eocd_offset) == -1 || cd->magic != ZIP64_EOCD_MAGIC)
+		return -1;
+
+	return 0;
+}
+
+// Replaces the sentinel sizes and offset of entry with the real ones from the
+// ZIP64 extra field. The field only holds the values that didn't fit, in the
+// order uncompressed size, compressed size, offset.
+static int zip64_read_extra(struct zip_entry *entry, const unsigned char *extra, uint16_t extra_len)
+{
+	uint16_t id, len, pos = 0;
+	const unsigned char *p;
+
+	while (extra_len - pos >= 4)
+	{
+		memcpy(&id, extra + pos, 2);
+		memcpy(&len, extra + pos + 2, 2);
+		pos += 4;
+		if (extra_len - pos < len)
+			return -1;
+
+		if (id == ZIP64_EXTRA_ID)
+		{
+			p = extra + pos;
+			if (entry->unzip_size == ZIP64_SENTINEL)
+			{
+				if (p + 8 > extra + pos + len)
+					return -1;
+				memcpy(&entry->unzip_size, p, 8);
+				p += 8;
+			}
+			if (entry->zip_size == ZIP64_SENTINEL)
+			{
+				if (p + 8 > extra + pos + len)
+					return -1;
+				memcpy(&entry->zip_size, p, 8);
+				p += 8;
+			}
+			if (entry->offset == ZIP64_SENTINEL)
+			{
+				if (p + 8 > extra + pos + len)
+					return -1;
+				memcpy(&entry->offset, p, 8);
+			}
+			return 0;
+		}
+		pos += len;
+	}
+
+	return -1;
+}
+
+// Loads the whole central directory with a single read (or none at all if the
+// zip is mapped) and decodes it into table. Returns -1 if the directory isn't
+// where the EOCD says it is, or a record is cut short.
+static int zip_load_table(struct zip_input *zip, struct zip64_eocd *zip_footer, struct zip_table *table)
+{
+	struct zip_directory zip_dir;
+	struct zip_entry *entry;
+	unsigned char *buffer = NULL;
+	const unsigned char *cd;
+	uint64_t cd_size = zip_footer->central_dir_size;
+	uint64_t pos, names_len = 0;
+	uint64_t i;
+
+	table->count = 0;
+	table->entries = NULL;
+	table->names = NULL;
+	if (zip_footer->total_central_records > UINT32_MAX || cd_size > (uint64_t)zip->size)
+		return -1;
+
+	table->entries = malloc(sizeof(struct zip_entry) * (zip_footer->total_central_records + 1));
+	// names can't take up more room than the directory itself, plus a NUL each
+	table->names = malloc(cd_size + zip_footer->total_central_records + 1);
+	if (!table->entries || !table->names)
+		goto fail;
+
+	zip_input_willneed(zip, zip_footer->central_dir_offset, cd_size);
+	cd = zip_input_ptr(zip, zip_footer->central_dir_offset, cd_size);
+	if (!cd)
+	{
+		buffer = malloc(cd_size + 1);
+		if (!buffer || zip_input_read(zip, buffer, cd_size, zip_footer->central_dir_offset) == -1)
+			goto fail;
+		cd = buffer;
+	}
+
+	for (i = 0, pos = 0; i < zip_footer->total_central_records; i++)
+	{
+		if (cd_size - pos < 46)
+			goto fail;
+		memcpy(&zip_dir, cd + pos, 46);
+		if (zip_dir.magic != ZIP_CD_MAGIC)
+			goto fail;
+		pos += 46;
+		if (cd_size - pos < (uint64_t)zip_dir.fname_len + zip_dir.extra_len + zip_dir.comment_len)
+			goto fail;
+
+		entry = &table->entries[table->count++];
+		entry->offset = zip_dir.offset;
+		entry->zip_size = zip_dir.zip_size;
+		entry->unzip_size = zip_dir.unzip_size;
+		entry->crc32 = zip_dir.crc32;
+		entry->dos_time = (uint32_t)zip_dir.mdate << 16 | zip_dir.mtime;
+		entry->compression = zip_dir.compression;
+		entry->name = names_len;
+		entry->name_len = zip_dir.fname_len;
+		entry->link = 0;
+
+		memcpy(table->names + names_len, cd + pos, zip_dir.fname_len);
+		names_len += zip_dir.fname_len;
+		table->names[names_len++] = 0;
+
+		if (zip_dir.offset == ZIP64_SENTINEL || zip_dir.zip_size == ZIP64_SENTINEL || zip_dir.unzip_size == ZIP64_SENTINEL)
+			if (zip64_read_extra(entry, cd + pos + zip_dir.fname_len, zip_dir.extra_len) == -1)
+				goto fail;
+
+		// skip over the rest of the record, it isn't needed
+		pos += zip_dir.fname_len + zip_dir.extra_len + zip_dir.comment_len;
+	}
+
+	free(buffer);
+	return 0;
+
+fail:
+	free(buffer);
+	free(table->entries);
+	free(table->names);
+	table->entries = NULL;
+	table->names = NULL;
+	table->count = 0;
+	return -1;
+}
+
+static void zip_free_table(struct zip_table *table)
+{
+	free(table->entries);
+	free(table->names);
+}
+
+// ---------------------- name filters ----------------------
+
+// Which entries get converted: those matching one of the include patterns or
+// named in the list (everything, if there are neither), and not matching 
+// any of the exclude patterns. Patterns are fnmatch() globs, where * also 
+// matches across /. The list is exact names, kept in a hash table so that 
+// long lists don't slow down huge archives.
+struct name_filter
+{
+	char **include;
+	int include_count;
+	char **exclude;
+	int exclude_count;
+	unsigned char *names; // the listed names, each one NUL terminated
+	uint64_t names_len, names_capacity;
+	uint32_t list_count;
+	uint32_t *slots; // offset + 1 of a name in names, 0 for an empty slot
+	uint32_t slot_mask;
+};
+
+// FNV-1a
+static uint32_t name_hash(const unsigned char *name, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len-- > 0)
+		h = (h ^ *name++) * 16777619U;
+
+	return h;
+}
+
+static inline int filter_active(struct name_filter *filter)
+{
+	return filter->include_count > 0 || filter->exclude_count > 0 || filter->list_count > 0;
+}
+
+// Adds every line of the file at path to the list of names
+static int filter_read_list(struct name_filter *filter, const char *path)
+{
+	FILE *list;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	void *p;
+
+	list = (path[0] == '-' && path[1] == 0) ? stdin : fopen(path, "r");
+	if (!list)
+		return -1;
+
+	while ((len = getline(&line, &size, list)) != -1)
+	{
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			len--;
+		if (len == 0 || len > 65535)
+			continue;
+
+		if (filter->names_len + len + 1 > filter->names_capacity)
+		{
+			p = realloc(filter->names, (filter->names_len + len + 1) * 2);
+			if (!p)
+				break;
+			filter->names = p;
+			filter->names_capacity = (filter->names_len + len + 1) * 2;
+		}
+		memcpy(filter->names + filter->names_len, line, len);
+		filter->names[filter->names_len + len] = 0;
+		filter->names_len += len + 1;
+		filter->list_count++;
+	}
+
+	free(line);
+	if (list != stdin)
+		fclose(list);
+
+	return len == -1 && filter->names_len < UINT32_MAX ? 0 : -1;
+}
+
+// Builds the hash table over the listed names, at most half full
+static int filter_build(struct name_filter *filter)
+{
+	uint64_t pos;
+	uint32_t size = 1, slot;
+
+	if (filter->list_count == 0)
+		return 0;
+
+	while (size < filter->list_count * 2)
+		size <<= 1;
+	filter->slots = calloc(size, sizeof(uint32_t));
+	if (!filter->slots)
+		return -1;
+	filter->slot_mask = size - 1;
+
+	for (pos = 0; pos < filter->names_len; pos += strlen((char *)filter->names + pos) + 1)
+	{
+		slot = name_hash(filter->names + pos, strlen((char *)filter->names + pos)) & filter->slot_mask;
+		while (filter->slots[slot] != 0)
+			slot = (slot + 1) & filter->slot_mask;
+		filter->slots[slot] = pos + 1;
+	}
+
+	return 0;
+}
+
+static void filter_free(struct name_filter *filter)
+{
+	free(filter->names);
+	free(filter->slots);
+}
+
+static int filter_listed(struct name_filter *filter, const unsigned char *name, uint16_t len)
+{
+	const unsigned char *listed;
+	uint32_t slot;
+
+	for (slot = name_hash(name, len) & filter->slot_mask; filter->slots[slot] != 0; slot = (slot + 1) & filter->slot_mask)
+	{
+		listed = filter->names + filter->slots[slot] - 1;
+		if (memcmp(listed, name, len) == 0 && listed[len] == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+// Whether the entry called name (NUL terminated, len long) gets converted
+static int filter_match(struct name_filter *filter, const unsigned char *name, uint16_t len)
+{
+	int i, keep;
+
+	keep = filter->include_count == 0 && filter->list_count == 0;
+	if (!keep && filter->list_count > 0)
+		keep = filter_listed(filter, name, len);
+	for (i = 0; !keep && i < filter->include_count; i++)
+		keep = fnmatch(filter->include[i], (const char *)name, 0) == 0;
+	for (i = 0; keep && i < filter->exclude_count; i++)
+		keep = fnmatch(filter->exclude[i], (const char *)name, 0) != 0;
+
+	return keep;
+}
+
+// Drops the entries that don't match from table. This happens before 
+// anything but the central directory has been read, so entries that aren't 
+// wanted never cost any I/O.
+static void zip_filter_table(struct zip_table *table, struct name_filter *filter)
+{
+	uint32_t n, kept;
+
+	for (n = 0, kept = 0; n < table->count; n++)
+		if (filter_match(filter, table->names + table->entries[n].name, table->entries[n].name_len))
+			table->entries[kept++] = table->entries[n];
+	table->count = kept;
+
+	// the entries moved, and what they linked to might be gone
+	for (n = 0; n < kept; n++)
+		table->entries[n].link = 0;
+}
+
+// ---------------------- name filters end ------------------
+
+// ---------------------- duplicates ----------------------
+
+// Zips often have the same file in them many times over under different 
+// names. Entries that have the same crc, sizes and method as an earlier one
+// are compared with it byte for byte, compressed, and if they're the same 
+// they're written as hard links to it. Only an entry whose name fits in a 
+// tar header's linkname (with .gz on the end) can be linked to.
+#define DEDUP_MAX_TARGET (100 - 4)
+
+static inline int dedup_key_equal(struct zip_entry *a, struct zip_entry *b)
+{
+	return a->crc32 == b->crc32 && a->zip_size == b->zip_size && a->unzip_size == b->unzip_size &&
+		a->compression == b->compression;
+}
+
+// Returns 1 if the data of a and b is the same, 0 if it isn't, -1 if it 
+// couldn't be read
+static int dedup_same_data(struct zip_input *zip, struct zip_entry *a, struct zip_entry *b)
+{
+	unsigned char x[COPY_BUFFER_SIZE], y[COPY_BUFFER_SIZE];
+	const unsigned char *p, *q;
+	off_t from = zip_data_offset(zip, a), to = zip_data_offset(zip, b);
+	uint64_t len = a->zip_size;
+	size_t n;
+
+	if (from == -1 || to == -1)
+		return -1;
+
+	p = zip_input_ptr(zip, from, len);
+	q = zip_input_ptr(zip, to, len);
+	if (p && q)
+		return memcmp(p, q, len) == 0;
+
+	for (; len > 0; len -= n, from += n, to += n)
+	{
+		n = len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE;
+		if (zip_input_read(zip, x, n, from) == -1 || zip_input_read(zip, y, n, to) == -1)
+			return -1;
+		if (memcmp(x, y, n) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+// Sets the link of every entry of table that duplicates an earlier one. The
+// entries are put in a hash table keyed on their crc and size as they go.
+static int zip_dedup_table(struct zip_input *zip, struct zip_table *table)
+{
+	struct zip_entry *entry, *first;
+	uint32_t *slots, mask = 1, n, i;
+	int same;
+
+	while (mask < table->count * 2)
+		mask <<= 1;
+	slots = calloc(mask, sizeof(uint32_t));
+	if (!slots)
+		return -1;
+	mask--;
+
+	for (n = 0; n < table->count; n++)
+	{
+		entry = &table->entries[n];
+		entry->link = 0;
+		if (entry->zip_size == 0 || entry->name_len + 5 > 512 || // see entry_name()
+			(entry->compression != ZIP_ALG_DEFLATE && entry->compression != ZIP_ALG_STORE))
+			continue;
+
+		// the same name twice can't be a link to itself
+		for (i = (entry->crc32 ^ (uint32_t)entry->zip_size * 0x9e3779b1) & mask; slots[i]; i = (i + 1) & mask)
+		{
+			first = &table->entries[slots[i] - 1];
+			if (!dedup_key_equal(first, entry) || (first->name_len == entry->name_len &&
+				memcmp(table->names + first->name, table->names + entry->name, entry->name_len) == 0))
+				continue;
+			same = dedup_same_data(zip, first, entry);
+			if (same == -1)
+			{
+				free(slots);
+				return -1;
+			}
+			if (same)
+			{
+				entry->link = slots[i];
+				break;
+			}
+		}
+		if (!entry->link && entry->name_len <= DEDUP_MAX_TARGET)
+			slots[i] = n + 1;
+	}
+
+	free(slots);
+	return 0;
+}
+
+// ---------------------- duplicates end ------------------
+
+// ---------------------- physical order ----------------------
+
+// The central directory can list the entries in any order, and a zip made 
+// by a tool that sorts it (or that appended to the zip) sends each read to 
+// some other part of the file, which a disk or a network filesystem pays 
+// for in seeks and the kernel's readahead can't guess. Going through the 
+// entries by the offset of their local headers reads the zip front to 
+// back instead, and entries lying next to each other are asked for 
+// together, so that they come in as a few big reads rather than one each.
+
+#define READ_AHEAD_BYTES (8 * 1024 * 1024) // the most asked for in one go
+#define READ_AHEAD_GAP (64 * 1024) // entries closer than this are read together, gap and all
+
+static int order_compare(const void *a, const void *b, void *arg)
+{
+	struct zip_table *table = arg;
+	uint64_t x = table->entries[*(const uint32_t *)a].offset;
+	uint64_t y = table->entries[*(const uint32_t *)b].offset;
+
+	return x < y ? -1 : x > y;
+}
+
+// Returns the indices of the entries of table, sorted by where they are in 
+// the zip, or NULL if there's no memory for them
+static uint32_t *table_physical_order(struct zip_table *table)
+{
+	uint32_t *order, n;
+
+	order = malloc(sizeof(uint32_t) * (table->count ? table->count : 1));
+	if (!order)
+		return NULL;
+	for (n = 0; n < table->count; n++)
+		order[n] = n;
+	qsort_r(order, table->count, sizeof(uint32_t), order_compare, table);
+
+	return order;
+}
+
+// Puts the entries of table in the order they are in the zip. Links are to
+// earlier entries, which they might not be any more, so they're dropped.
+static int zip_sort_table(struct zip_table *table)
+{
+	struct zip_entry *sorted;
+	uint32_t *order, n;
+
+	order = table_physical_order(table);
+	sorted = malloc(sizeof(struct zip_entry) * (table->count ? table->count : 1));
+	if (!order || !sorted)
+	{
+		free(order);
+		free(sorted);
+		return -1;
+	}
+
+	for (n = 0; n < table->count; n++)
+	{
+		sorted[n] = table->entries[order[n]];
+		sorted[n].link = 0;
+	}
+	free(table->entries);
+	table->entries = sorted;
+	free(order);
+
+	return 0;
+}
+
+// How far a walk over the entries (in table order, or through an order from
+// table_physical_order()) has asked the kernel to read. The run of entries 
+// at [start, mid) is the one being worked through, and [mid, ahead) is 
+// coming in behind it.
+struct read_ahead
+{
+	uint32_t start;
+	uint32_t mid;
+	uint32_t ahead;
+};
+
+// Asks for the entries from walk position pos on that lie close together in
+// the zip, in one go, and returns the position after the last of them
+static uint32_t read_run(struct zip_input *zip, struct zip_table *table, const uint32_t *order, uint32_t pos)
+{
+	struct zip_entry *entry = &table->entries[order ? order[pos] : pos];
+	uint64_t from = entry->offset, to, end;
+
+	to = from + sizeof(struct zip_local_file) + entry->name_len + entry->zip_size;
+	for (pos++; pos < table->count; pos++)
+	{
+		entry = &table->entries[order ? order[pos] : pos];
+		end = entry->offset + sizeof(struct zip_local_file) + entry->name_len + entry->zip_size;
+		if (entry->offset < from || entry->offset > to + READ_AHEAD_GAP || end - from > READ_AHEAD_BYTES)
+			break;
+		if (end > to)
+			to = end;
+	}
+
+	// the local extra field isn't in the central directory, and one big 
+	// entry is left to the kernel's own readahead past the first few MB
+	to += READ_AHEAD_GAP;
+	if (to - from > READ_AHEAD_BYTES)
+		to = from + READ_AHEAD_BYTES;
+	if (to > (uint64_t)zip->size)
+		to = zip->size;
+	if (from < to)
+		zip_input_willneed(zip, from, to - from);
+
+	return pos;
+}
+
+// Keeps the kernel a run of entries ahead of a walk that's got to pos
+static void read_ahead(struct read_ahead *ra, struct zip_input *zip, struct zip_table *table, const uint32_t *order, uint32_t pos)
+{
+	// the first entry, or a worker that stole from another's range
+	if (pos < ra->start || pos >= ra->ahead)
+	{
+		ra->start = ra->mid = pos;
+		ra->ahead = read_run(zip, table, order, pos);
+	}
+	if (pos >= ra->mid && ra->ahead < table->count)
+	{
+		ra->start = ra->mid;
+		ra->mid = ra->ahead;
+		ra->ahead = read_run(zip, table, order, ra->ahead);
+	}
+}
+
+// ---------------------- physical order end ------------------
+
+// Builds the name an entry gets in the output in fname: deflated entries 
+// become .gz files, except in a gzipped tarball. Returns the length of the
+// name, or -1 if it doesn't fit in fname_size bytes, or in a tarball.
+static int entry_name(struct zip_table *table, struct zip_entry *entry, uint8_t method, unsigned char *fname, size_t fname_size)
+{
+	size_t len = entry->name_len;
+
+	if (len + 5 > fname_size)
+		return -1;
+
+	memcpy(fname, table->names + entry->name, len);
+	if ((entry->compression == ZIP_ALG_DEFLATE || (method == BH_MODE_EXTRACT && compress_entry(entry))) &&
+		method != BH_MODE_MAKE_TGZ && method != BH_MODE_MAKE_TGZ_SINGLE)
+	{
+		memcpy(fname + len, ".gz", 3);
+		len += 3;
+	}
+	fname[len] = 0;
+
+	if (method != BH_MODE_EXTRACT && len > TAR_LONG_NAME_MAX)
+		return -1;
+
+	return len;
+}
+
+// Builds the name of the entry that entry is a hard link to, in the same 
+// way. Returns NULL if it isn't one.
+static unsigned char *entry_link(struct zip_table *table, struct zip_entry *entry, uint8_t method, unsigned char *lname, size_t lname_size)
+{
+	if (!entry->link || entry_name(table, &table->entries[entry->link - 1], method, lname, lname_size) == -1)
+		return NULL;
+
+	return lname;
+}
+
+// Writes the name of an entry to stdout on a line of its own, in one write 
+// so that lines from different threads don't get mixed up.
+static void echo_name(unsigned char *fname, int len)
+{
+	uint64_t t;
+
+	if (echo_fd == -1)
+		return;
+	t = stats_now();
+	fname[len] = '\n';
+	write(echo_fd, fname, len + 1);
+	stats_add(STAT_ECHO, t, len + 1);
+	fname[len] = 0;
+}
+
+// order, if it isn't NULL, is the order the entries are taken in, and ahead
+// is where each worker's read_ahead() is, or NULL to leave it to the kernel
+struct extract_job
+{
+	struct zip_input *zip;
+	struct zip_table *table;
+	const uint32_t *order;
+	struct read_ahead *ahead; // one for each worker
+};
+
+static int extract_job(void *arg, uint32_t index, int worker)
+{
+	struct extract_job *job = arg;
+	struct zip_entry *entry = &job->table->entries[job->order ? job->order[index] : index];
+	struct zip_source src;
+	unsigned char fname[512];
+	uint64_t start = stats_now();
+	int len;
+
+	if (job->ahead)
+		read_ahead(&job->ahead[worker], job->zip, job->table, job->order, index);
+	len = entry_name(job->table, entry, BH_MODE_EXTRACT, fname, sizeof(fname));
+	if (len == -1)
+	{
+		message("Skipping a file with a name that is too long.\n");
+		return 0;
+	}
+	// hard links wait for what they link to, see extract_links()
+	if (entry->link)
+		return 0;
+	echo_name(fname, len);
+
+	if (zip_source_entry(&src, job->zip, entry) == -1 || gz_create(fname, &src, entry) == -1)
+	{
+		message("Could not copy %s.\n", fname);
+		return -1;
+	}
+	stats_entry(start);
+
+	return 0;
+}
+
+// Once everything else has been extracted, makes the entries that are the 
+// same as an earlier one hard links to its file. Where that can't be done 
+// (the filesystem doesn't have them, or the entry it links to failed) the 
+// entry is extracted after all. One that can't be doesn't stop the rest.
+static int extract_links(struct extract_job *job)
+{
+	struct zip_entry *entry;
+	struct zip_source src;
+	unsigned char fname[512], lname[512];
+	uint64_t start;
+	uint32_t n;
+	int len, ret = 0;
+
+	for (n = 0; n < job->table->count; n++)
+	{
+		start = stats_now();
+		entry = &job->table->entries[n];
+		if (!entry->link || !entry_link(job->table, entry, BH_MODE_EXTRACT, lname, sizeof(lname)))
+			continue;
+		len = entry_name(job->table, entry, BH_MODE_EXTRACT, fname, sizeof(fname));
+		if (len == -1)
+			continue;
+		echo_name(fname, len);
+
+		if (link((char *)lname, (char *)fname) == -1 &&
+			(errno != EEXIST || unlink((char *)fname) == -1 || link((char *)lname, (char *)fname) == -1) &&
+			(zip_source_entry(&src, job->zip, entry) == -1 || gz_create(fname, &src, entry) == -1))
+		{
+			message("Could not copy %s.\n", fname);
+			ret = -1;
+			continue;
+		}
+		stats_entry(start);
+	}
+
+	return ret;
+}
+
+// Works out where each entry starts in the tarball, the same way the serial
+// loop in bh_convert() lays them out. In a plain tarball that's a header,
+// after a long name record if it needs one (see tar_long_name()), the file
+// data if it's copied at all, and padding. In a gzipped one it's a gzip 
+// member, see tgz_write(). Entries that get skipped get an offset of -1. If 
+// data_offsets isn't NULL, it gets where each entry's deflate or stored 
+// data starts (past the gzip header in a plain tarball).
+// Returns the size of the whole tarball.
+static off_t tar_plan(struct zip_table *table, uint8_t method, off_t *offsets, off_t *data_offsets)
+{
+	struct zip_entry *entry;
+	unsigned char fname[512];
+	uint64_t size;
+	uint32_t n, pad_bytes = 0, header_len;
+	off_t pos = 0;
+	int len;
+
+	for (n = 0; n < table->count; n++)
+	{
+		entry = &table->entries[n];
+		len = entry_name(table, entry, method, fname, sizeof(fname));
+		if (len == -1)
+		{
+			offsets[n] = -1;
+			if (data_offsets)
+				data_offsets[n] = -1;
+			continue;
+		}
+		offsets[n] = pos;
+		header_len = tar_long_name_len(fname, len) + sizeof(struct tar_posix_header);
+
+		// a hard link is a header (and an empty stored block), its data is
+		// the entry it links to's
+		if (method == BH_MODE_MAKE_TGZ)
+		{
+			pos += sizeof(struct gz_header) + sizeof(struct deflate_store_header) + pad_bytes + header_len;
+			if (data_offsets)
+				data_offsets[n] = entry->link ? data_offsets[entry->link - 1] : pos;
+			if (entry->link)
+			{
+				pos += sizeof(struct deflate_store_header) + sizeof(struct gz_footer);
+				pad_bytes = 0;
+				continue;
+			}
+
+			// stored data is cut into stored blocks, and there's always one
+			size = entry->zip_size;
+			if (entry->compression == ZIP_ALG_STORE)
+				size += sizeof(struct deflate_store_header) * (entry->zip_size ? (entry->zip_size + DEFLATE_STORED_MAX - 1) / DEFLATE_STORED_MAX : 1);
+			pos += size + sizeof(struct gz_footer);
+			pad_bytes = (512 - (entry->unzip_size % 512)) % 512;
+			continue;
+		}
+
+		if (entry->link)
+		{
+			if (data_offsets)
+				data_offsets[n] = data_offsets[entry->link - 1];
+			pos += header_len;
+			continue;
+		}
+		size = tar_entry_size(entry->zip_size, entry->compression == ZIP_ALG_DEFLATE);
+		if (data_offsets)
+			data_offsets[n] = pos + header_len + (entry->compression == ZIP_ALG_DEFLATE ? sizeof(struct gz_header) : 0);
+		pos += header_len + (512 - size % 512) % 512;
+		if (entry->compression == ZIP_ALG_DEFLATE || entry->compression == ZIP_ALG_STORE)
+			pos += size;
+	}
+
+	// see tgz_finish()
+	if (method == BH_MODE_MAKE_TGZ)
+		pos += sizeof(struct gz_header) + sizeof(struct deflate_store_header) + pad_bytes + 1024 + sizeof(struct gz_footer);
+
+	return pos;
+}
+
+// order and ahead are the same as in struct extract_job
+struct tar_job
+{
+	struct zip_input *zip;
+	struct zip_base *base;
+	struct zip_table *table;
+	off_t *offsets;
+	struct gather *out; // one for each worker
+	const uint32_t *order;
+	struct read_ahead *ahead;
+};
+
+static int tar_job(void *arg, uint32_t index, int worker)
+{
+	struct tar_job *job = arg;
+	struct gather *out = &job->out[worker];
+	struct zip_entry *entry;
+	struct zip_source src;
+	unsigned char fname[512], lname[512], *link;
+	uint64_t start = stats_now();
+	int len;
+
+	if (job->ahead)
+		read_ahead(&job->ahead[worker], job->zip, job->table, job->order, index);
+	if (job->order)
+		index = job->order[index];
+	entry = &job->table->entries[index];
+	if (job->offsets[index] == -1)
+	{
+		message("Skipping a file with a name that is too long.\n");
+		return 0;
+	}
+	len = entry_name(job->table, entry, BH_MODE_MAKE_TAR, fname, sizeof(fname));
+	echo_name(fname, len);
+
+	// a worker mostly gets entries in a row, and those go out together
+	if (out->offset + (off_t)out->bytes != job->offsets[index])
+	{
+		if (gather_flush(out) == -1)
+			return -1;
+		out->offset = job->offsets[index];
+	}
+
+	link = entry_link(job->table, entry, BH_MODE_MAKE_TAR, lname, sizeof(lname));
+	if ((!link && base_source_entry(&src, job->base, job->zip, job->table, index) == -1) || tar_write(fname, &src, out, entry, link) == -1)
+	{
+		message("Could not copy %s.\n", fname);
+		return -1;
+	}
+	stats_entry(start);
+
+	return 0;
+}
+
+// Writes a plain tarball on threads threads. Every entry's place in the 
+// tarball is known from the central directory, so the workers can write 
+// theirs with pwrite() in any order, and the result is the same as the one
+// written front to back. The space is allocated up front so that the file
+// doesn't have to grow (and fragment) under the threads. That's also what
+// lets the entries be read in order (see table_physical_order()) while the 
+// tarball keeps the order of the table, even on one thread. 
+static int tar_parallel(struct zip_input *zip, struct zip_base *base, struct zip_table *table, const uint32_t *order, int ahead, int tar_fd, int threads)
+{
+	struct tar_job job = {zip, base, table, NULL, NULL, order, NULL};
+	uint64_t t;
+	off_t size;
+	int i, ret = 0;
+
+	job.offsets = malloc(sizeof(off_t) * (table->count ? table->count : 1));
+	job.out = calloc(threads, sizeof(struct gather));
+	if (ahead)
+		job.ahead = calloc(threads, sizeof(struct read_ahead));
+	if (!job.offsets || !job.out || (ahead && !job.ahead))
+	{
+		free(job.offsets);
+		free(job.out);
+		free(job.ahead);
+		return -1;
+	}
+
+	size = tar_plan(table, BH_MODE_MAKE_TAR, job.offsets, NULL);
+	t = stats_now();
+	if (size > 0 && fallocate(tar_fd, 0, 0, size) == -1 && errno != EOPNOTSUPP && errno != ENOSYS)
+		ret = -1;
+	stats_add(STAT_OPEN, t, 0);
+
+	for (i = 0; i < threads && ret == 0; i++)
+	{
+		ret = gather_init(&job.out[i], tar_fd, GATHER_BYTES);
+		job.out[i].offset = 0;
+	}
+
+	if (ret == 0)
+		ret = pool_run(threads, table->count, tar_job, &job);
+
+	// whatever the workers still have gathered
+	for (i = 0; i < threads; i++)
+	{
+		if (gather_flush(&job.out[i]) == -1)
+			ret = -1;
+		gather_free(&job.out[i]);
+	}
+	free(job.offsets);
+	free(job.out);
+	free(job.ahead);
+
+	return ret;
+}
+
+// ---------------------- index ----------------------
+
+// An index of a tarball, kept next to it as <tar file>.idx, so that one 
+// entry can be found without reading the tarball. It's written to be used 
+// straight out of a mapping: a header, the entries sorted by the hash of 
+// their names, the first entry of each hash bucket, and the names. The 
+// bucket of a name is the top bucket_bits of its hash. All numbers are 
+// little endian.
+#define INDEX_MAGIC 0x58494842 // "BHIX"
+#define INDEX_VERSION 1
+
+struct index_header
+{
+	uint32_t magic;
+	uint16_t version;
+	uint8_t method;      // BH_MODE_MAKE_TAR or BH_MODE_MAKE_TGZ
+	uint8_t bucket_bits;
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t buckets_offset; // uint32_t[(1 << bucket_bits) + 1]
+	uint64_t names_offset;
+	uint64_t names_len;
+};
+
+struct index_entry
+{
+	uint64_t header_offset; // of the tar header, or of the gzip member in a tar.gz
+	uint64_t data_offset;   // of the deflate or stored data
+	uint64_t zip_size;      // bytes of data at data_offset
+	uint64_t unzip_size;
+	uint32_t crc32;
+	uint32_t hash;
+	uint32_t name; // offset in the names, which are NUL terminated
+	uint16_t name_len;
+	uint16_t compression; // ZIP_ALG_DEFLATE or ZIP_ALG_STORE
+};
+
+static inline uint32_t index_bucket(uint32_t hash, int bits)
+{
+	return bits ? hash >> (32 - bits) : 0;
+}
+
+static int index_compare(const void *a, const void *b)
+{
+	const struct index_entry *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	// entries with the same name stay in tarball order
+	return x->header_offset < y->header_offset ? -1 : x->header_offset > y->header_offset;
+}
+
+// Writes the index of the tarball that was made from table with method to
+// index_fd.
+static int index_write(int index_fd, struct zip_table *table, uint8_t method)
+{
+	struct index_header header = {0};
+	struct index_entry *entries = NULL;
+	struct zip_entry *entry;
+	off_t *offsets, *data_offsets;
+	uint32_t *buckets = NULL, n, count = 0, b;
+	uint64_t names_len = 0;
+	int bits = 0, ret = -1;
+
+	offsets = malloc(sizeof(off_t) * (table->count + 1));
+	data_offsets = malloc(sizeof(off_t) * (table->count + 1));
+	entries = malloc(sizeof(struct index_entry) * (table->count + 1));
+	if (!offsets || !data_offsets || !entries)
+		goto done;
+
+	tar_plan(table, method, offsets, data_offsets);
+
+	for (n = 0; n < table->count; n++)
+	{
+		entry = &table->entries[n];
+		if (offsets[n] == -1 || (entry->compression != ZIP_ALG_DEFLATE && entry->compression != ZIP_ALG_STORE))
+			continue;
+
+		entries[count].header_offset = offsets[n];
+		entries[count].data_offset = data_offsets[n];
+		entries[count].zip_size = entry->zip_size;
+		entries[count].unzip_size = entry->unzip_size;
+		entries[count].crc32 = entry->crc32;
+		entries[count].hash = name_hash(table->names + entry->name, entry->name_len);
+		entries[count].name = names_len;
+		entries[count].name_len = entry->name_len;
+		entries[count].compression = entry->compression;
+
+		// in a tar.gz, stored data was cut into stored blocks, so it's deflate now
+		if (method == BH_MODE_MAKE_TGZ && entry->compression == ZIP_ALG_STORE)
+		{
+			entries[count].compression = ZIP_ALG_DEFLATE;
+			entries[count].zip_size += sizeof(struct deflate_store_header) *
+				(entry->zip_size ? (entry->zip_size + DEFLATE_STORED_MAX - 1) / DEFLATE_STORED_MAX : 1);
+		}
+
+		names_len += entry->name_len + 1;
+		count++;
+	}
+
+	qsort(entries, count, sizeof(struct index_entry), index_compare);
+
+	// about one entry per bucket
+	while (bits < 31 && (1U << bits) < count)
+		bits++;
+	buckets = malloc(sizeof(uint32_t) * ((1U << bits) + 1));
+	if (!buckets)
+		goto done;
+	for (b = 0, n = 0; b <= (1U << bits); b++)
+	{
+		while (n < count && index_bucket(entries[n].hash, bits) < b)
+			n++;
+		buckets[b] = n;
+	}
+
+	header.magic = INDEX_MAGIC;
+	header.version = INDEX_VERSION;
+	header.method = method;
+	header.bucket_bits = bits;
+	header.count = count;
+	header.buckets_offset = sizeof(header) + sizeof(struct index_entry) * (uint64_t)count;
+	header.names_offset = header.buckets_offset + sizeof(uint32_t) * ((1U << bits) + 1);
+	header.names_len = names_len;
+
+	// the names go in the order they were given offsets in, not sorted
+	if (write_all(index_fd, &header, sizeof(header)) == -1 ||
+		write_all(index_fd, entries, sizeof(struct index_entry) * count) == -1 ||
+		write_all(index_fd, buckets, sizeof(uint32_t) * ((1U << bits) + 1)) == -1)
+		goto done;
+	for (n = 0; n < table->count; n++)
+	{
+		entry = &table->entries[n];
+		if (offsets[n] == -1 || (entry->compression != ZIP_ALG_DEFLATE && entry->compression != ZIP_ALG_STORE))
+			continue;
+		if (write_all(index_fd, table->names + entry->name, entry->name_len + 1) == -1)
+			goto done;
+	}
+	ret = 0;
+
+done:
+	free(offsets);
+	free(data_offsets);
+	free(entries);
+	free(buckets);
+	return ret;
+}
+
+// Finds name in the index mapped at map, and returns its entry or NULL. 
+// Everything that's read from the index is checked against its size first.
+static struct index_entry *index_find(const unsigned char *map, size_t size, const unsigned char *name, size_t name_len)
+{
+	const struct index_header *header = (const struct index_header *)map;
+	struct index_entry *entries = (struct index_entry *)(map + sizeof(struct index_header));
+	const uint32_t *buckets;
+	uint32_t hash, b, n, end;
+
+	if (size < sizeof(struct index_header) || header->magic != INDEX_MAGIC || header->version != INDEX_VERSION ||
+		header->bucket_bits > 31 ||
+		header->buckets_offset != sizeof(struct index_header) + sizeof(struct index_entry) * (uint64_t)header->count ||
+		header->names_offset != header->buckets_offset + sizeof(uint32_t) * ((1ULL << header->bucket_bits) + 1) ||
+		header->names_offset > size || header->names_len > size - header->names_offset)
+		return NULL;
+	buckets = (const uint32_t *)(map + header->buckets_offset);
+
+	hash = name_hash(name, name_len);
+	b = index_bucket(hash, header->bucket_bits);
+	end = buckets[b + 1] < header->count ? buckets[b + 1] : header->count;
+	for (n = buckets[b]; n < end; n++)
+		if (entries[n].hash == hash && entries[n].name_len == name_len &&
+			(uint64_t)entries[n].name + name_len < header->names_len &&
+			memcmp(map + header->names_offset + entries[n].name, name, name_len) == 0)
+			return &entries[n];
+
+	return NULL;
+}
+
+// Finds the entries of table that haven't changed since the tarball at 
+// tar_path was made, through its index: the ones with the same name, crc, 
+// sizes and compression. The data at an entry's data offset is the same in 
+// a plain tarball and a gzipped one, a deflate stream or stored data, so 
+// either can be the base for either. Stored entries of a gzipped one have 
+// been cut into stored blocks, and their compression in the index doesn't 
+// match. An index older than its tarball might not be its index at all.
+// Returns how many entries were found, or -1.
+static int64_t index_base(struct zip_base *base, const char *tar_path, int map, struct zip_table *table)
+{
+	struct index_entry *found;
+	struct zip_input index;
+	struct zip_entry *entry;
+	struct stat tar_stat, index_stat;
+	char path[4096];
+	int64_t count = 0;
+	uint32_t n;
+
+	if (snprintf(path, sizeof(path), "%s.idx", tar_path) >= (int)sizeof(path) ||
+		zip_input_open(&index, path, 1) == -1)
+	{
+		message("Could not open the index, %s.\n", path);
+		return -1;
+	}
+	if (!index.map || zip_input_open(&base->tar, tar_path, map) == -1)
+	{
+		message("Could not open %s.\n", tar_path);
+		zip_input_close(&index);
+		return -1;
+	}
+	if (fstat(index.fd, &index_stat) == -1 || fstat(base->tar.fd, &tar_stat) == -1 ||
+		index_stat.st_mtim.tv_sec < tar_stat.st_mtim.tv_sec ||
+		(index_stat.st_mtim.tv_sec == tar_stat.st_mtim.tv_sec && index_stat.st_mtim.tv_nsec < tar_stat.st_mtim.tv_nsec))
+	{
+		message("%s was changed after its index was written.\n", tar_path);
+		zip_input_close(&base->tar);
+		zip_input_close(&index);
+		return -1;
+	}
+	base->offsets = malloc(sizeof(off_t) * (table->count + 1));
+	if (!base->offsets)
+	{
+		zip_input_close(&base->tar);
+		zip_input_close(&index);
+		return -1;
+	}
+
+	for (n = 0; n < table->count; n++)
+	{
+		entry = &table->entries[n];
+		base->offsets[n] = -1;
+		found = index_find(index.map, index.size, table->names + entry->name, entry->name_len);
+		if (!found || found->crc32 != entry->crc32 || found->zip_size != entry->zip_size ||
+			found->unzip_size != entry->unzip_size || found->compression != entry->compression ||
+			found->data_offset > (uint64_t)base->tar.size || found->zip_size > base->tar.size - found->data_offset)
+			continue;
+		base->offsets[n] = found->data_offset;
+		count++;
+	}
+
+	zip_input_close(&index);
+	return count;
+}
+
+// Writes the entry called name in the tarball at tar_path to out_fd, found
+// through the index next to it. Deflated entries come out as .gz files, the
+// same as with -x. Names in the tarball with .gz added are found as well.
+int bh_lookup(const char *tar_path, const char *name, int flags, int out_fd)
+{
+	struct index_entry *found;
+	struct zip_input tar, index;
+	struct zip_source src;
+	struct gather out;
+	struct gz_header header = {0};
+	struct gz_footer footer;
+	char path[4096];
+	size_t len = strlen(name);
+	int ret = BH_ERR_IO;
+
+	if (snprintf(path, sizeof(path), "%s.idx", tar_path) >= (int)sizeof(path) ||
+		zip_input_open(&index, path, 1) == -1)
+	{
+		message("Could not open the index, %s.\n", path);
+		return BH_ERR_IO;
+	}
+	if (!index.map)
+	{
+		zip_input_close(&index);
+		return BH_ERR_IO;
+	}
+
+	found = index_find(index.map, index.size, (const unsigned char *)name, len);
+	if (!found && len > 3 && memcmp(name + len - 3, ".gz", 3) == 0)
+		found = index_find(index.map, index.size, (const unsigned char *)name, len - 3);
+	if (!found)
+	{
+		message("%s is not in the index.\n", name);
+		zip_input_close(&index);
+		return BH_ERR_NAME;
+	}
+
+	if (zip_input_open(&tar, tar_path, flags & BH_OPEN_MMAP) == -1)
+	{
+		message("Could not open %s.\n", tar_path);
+		zip_input_close(&index);
+		return BH_ERR_IO;
+	}
+
+	header.magic = GZ_MAGIC;
+	header.method = GZ_METHOD_DEFLATE;
+	header.flags = 0;
+	header.os = GZ_OS_LINUX;
+
+	footer.crc = found->crc32;
+	footer.isize = found->unzip_size;
+
+	src.zip = &tar;
+	src.offset = found->data_offset;
+	src.stream = NULL;
+
+	gather_init(&out, out_fd, 0);
+	if ((found->compression != ZIP_ALG_DEFLATE || gather_add(&out, &header, sizeof(header)) == 0) &&
+		gather_source(&out, &src, found->zip_size) == 0 &&
+		(found->compression != ZIP_ALG_DEFLATE || gather_add(&out, &footer, sizeof(footer)) == 0) &&
+		gather_flush(&out) == 0)
+		ret = BH_OK;
+
+	zip_input_close(&tar);
+	zip_input_close(&index);
+	return ret;
+}
+
+// ---------------------- index end ----------------------
+
+// ---------------------- io_uring extract ----------------------
+#ifdef BH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+// Entries in flight at once, and the most file data they can hold between them
+#define URING_DEPTH 64
+#define URING_BATCH_BYTES (8 * 1024 * 1024)
+// Anything bigger is left to gz_create(), where copy_file_range() does better
+#define URING_MAX_ENTRY (1024 * 1024)
+
+// What a completion is for, in the low bits of its user_data. The rest is the slot.
+#define URING_HEADER 0
+#define URING_READ   1
+#define URING_OPEN   2
+#define URING_WRITE  3
+#define URING_CLOSE  4
+
+// A raw io_uring, set up with the syscalls directly so there's no dependency
+struct uring
+{
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+	unsigned sq_pending;
+};
+
+// One entry being extracted. Its requests are linked, so they run in order
+// and the rest are cancelled if one fails: read the data from the zip, 
+// open the output into a fixed file slot, write it all with one writev, 
+// and close the slot.
+struct uring_slot
+{
+	struct zip_entry *entry;
+	struct zip_local_file file_entry;
+	struct gz_header header;
+	struct gz_footer footer;
+	struct iovec iov[3];
+	unsigned char *data;
+	unsigned char fname[512];
+	uint64_t start; // for stats_entry()
+	int len;
+	int failed;
+};
+
+static int uring_setup(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p = {0};
+	int files[URING_DEPTH];
+	unsigned i;
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd == -1)
+		return -1;
+	ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_len = ring->cq_ring_len = ring->sq_ring_len > ring->cq_ring_len ? ring->sq_ring_len : ring->cq_ring_len;
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+	{
+		ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+	ring->sq_pending = 0;
+
+	// an empty table of fixed files for the outputs to be opened into
+	for (i = 0; i < URING_DEPTH; i++)
+		files[i] = -1;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, URING_DEPTH) == -1)
+		goto fail;
+
+	return 0;
+
+fail:
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	if (ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+	return -1;
+}
+
+static void uring_close(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+}
+
+// Returns a cleared submission queue entry, the ring is sized so it can't be full
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned tail = *ring->sq_tail + ring->sq_pending;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	ring->sq_array[index] = index;
+	ring->sq_pending++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	return sqe;
+}
+
+// Submits everything queued and waits for wait completions, handing each 
+// one to slots[user_data].
+static int uring_submit_and_wait(struct uring *ring, struct uring_slot *slots, unsigned wait)
+{
+	unsigned head, submit = ring->sq_pending;
+	struct io_uring_cqe *cqe;
+	struct uring_slot *slot;
+	uint64_t t;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+	ring->sq_pending = 0;
+
+	while (wait > 0)
+	{
+		t = stats_now();
+		ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+		stats_add(STAT_URING, t, 0);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			return -1;
+		submit = 0;
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			slot = &slots[cqe->user_data >> 3];
+			// every step has to do all of its work, a short read or write is a failure too
+			switch (cqe->user_data & 7)
+			{
+				case URING_HEADER:
+					if (cqe->res != 30)
+						slot->failed = 1;
+					stats_bytes(STAT_READ, cqe->res > 0 ? cqe->res : 0);
+					break;
+				case URING_READ:
+					if (cqe->res != (int)slot->iov[1].iov_len)
+						slot->failed = 1;
+					stats_bytes(STAT_READ, cqe->res > 0 ? cqe->res : 0);
+					break;
+				case URING_OPEN:
+				case URING_CLOSE:
+					if (cqe->res < 0)
+						slot->failed = 1;
+					stats_bytes(STAT_OPEN, 0);
+					break;
+				case URING_WRITE:
+					if (cqe->res != (int)(slot->iov[0].iov_len + slot->iov[1].iov_len + slot->iov[2].iov_len))
+						slot->failed = 1;
+					stats_bytes(STAT_WRITE, cqe->res > 0 ? cqe->res : 0);
+					break;
+			}
+			head++;
+			wait--;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+// Opening straight into a fixed file slot (file_index) came in Linux 5.15,
+// older kernels have IORING_OP_OPENAT but fail it. So the current directory
+// is opened into slot 0 and closed again, and if either fails io_uring 
+// can't be used.
+static int uring_probe(struct uring *ring)
+{
+	struct uring_slot slot = {0};
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)".";
+	sqe->open_flags = O_RDONLY | O_DIRECTORY;
+	sqe->file_index = 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = URING_OPEN;
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = 1;
+	sqe->user_data = URING_CLOSE;
+
+	if (uring_submit_and_wait(ring, &slot, 2) == -1 || slot.failed)
+		return -1;
+	return 0;
+}
+
+// Extracts the entries in batches of up to URING_DEPTH through io_uring. 
+// The local headers of a batch are read in one submission, then every 
+// entry gets a linked read, openat, writev and close, all submitted with a 
+// single syscall. Entries too big for a batch go through gz_create().
+// Returns -2 if io_uring isn't available, so the caller can do it the old way.
+// order is the same as in struct extract_job.
+static int uring_extract(struct zip_input *zip, struct zip_table *table, const uint32_t *order)
+{
+	struct uring ring;
+	struct uring_slot *slots;
+	struct uring_slot *slot;
+	struct io_uring_sqe *sqe;
+	struct zip_source src;
+	unsigned char *buffer, *p, parent[sizeof(slots->fname)];
+	uint32_t n = 0;
+	unsigned count, i;
+	size_t used, parent_len = 0;
+	int ret = 0;
+
+	slots = calloc(URING_DEPTH, sizeof(struct uring_slot));
+	buffer = malloc(URING_BATCH_BYTES);
+	if (!slots || !buffer || uring_setup(&ring, URING_DEPTH * 4) == -1)
+	{
+		free(slots);
+		free(buffer);
+		return -2;
+	}
+	if (uring_probe(&ring) == -1)
+	{
+		uring_close(&ring);
+		free(slots);
+		free(buffer);
+		return -2;
+	}
+
+	while (n < table->count)
+	{
+		// fill a batch
+		for (count = 0, used = 0; n < table->count && count < URING_DEPTH; n++)
+		{
+			struct zip_entry *entry = &table->entries[order ? order[n] : n];
+
+			if (entry->link) // see extract_links()
+				continue;
+			slot = &slots[count];
+			slot->start = stats_now();
+			slot->entry = entry;
+			slot->failed = 0;
+			slot->len = entry_name(table, entry, BH_MODE_EXTRACT, slot->fname, sizeof(slot->fname));
+			if (slot->len == -1)
+			{
+				message("Skipping a file with a name that is too long.\n");
+				continue;
+			}
+			// big entries, and directories (which a batch would open as 
+			// files), go the usual way
+			if (entry->zip_size > URING_MAX_ENTRY || (slot->len > 0 && slot->fname[slot->len - 1] == '/'))
+			{
+				echo_name(slot->fname, slot->len);
+				if (zip_source_entry(&src, zip, entry) == -1 || gz_create(slot->fname, &src, entry) == -1)
+				{
+					message("Could not copy %s.\n", slot->fname);
+					ret = -1;
+				}
+				else
+					stats_entry(slot->start);
+				continue;
+			}
+			if (used + entry->zip_size > URING_BATCH_BYTES)
+				break;
+
+			// the openat can't make the directories the file is in, so 
+			// they're made here, once for a run of files in the same one
+			p = memrchr(slot->fname, '/', slot->len);
+			if (p && ((size_t)(p - slot->fname) != parent_len || memcmp(parent, slot->fname, parent_len) != 0))
+			{
+				if (make_parents(slot->fname) == -1)
+				{
+					message("Could not copy %s.\n", slot->fname);
+					ret = -1;
+					continue;
+				}
+				parent_len = p - slot->fname;
+				memcpy(parent, slot->fname, parent_len);
+			}
+			slot->data = buffer + used;
+			used += entry->zip_size;
+
+			sqe = uring_get_sqe(&ring);
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = zip->fd;
+			sqe->addr = (uintptr_t)&slot->file_entry;
+			sqe->len = 30;
+			sqe->off = entry->offset;
+			sqe->user_data = ((uint64_t)count << 3) | URING_HEADER;
+			count++;
+		}
+		if (count == 0)
+			continue;
+		if (uring_submit_and_wait(&ring, slots, count) == -1)
+		{
+			ret = -1;
+			break;
+		}
+
+		// now the data offsets are known
+		for (i = 0; i < count; i++)
+		{
+			slot = &slots[i];
+			if (slot->failed || slot->file_entry.magic != ZIP_FILE_MAGIC)
+			{
+				slot->failed = 1;
+				continue;
+			}
+
+			memset(&slot->header, 0, sizeof(struct gz_header));
+			slot->header.magic = GZ_MAGIC;
+			slot->header.method = GZ_METHOD_DEFLATE;
+			slot->header.os = GZ_OS_LINUX;
+			slot->footer.crc = slot->entry->crc32;
+			slot->footer.isize = slot->entry->unzip_size;
+
+			// stored files are extracted as they are
+			slot->iov[0].iov_base = &slot->header;
+			slot->iov[0].iov_len = slot->entry->compression == ZIP_ALG_DEFLATE ? sizeof(struct gz_header) : 0;
+			slot->iov[1].iov_base = slot->data;
+			slot->iov[1].iov_len = slot->entry->zip_size;
+			slot->iov[2].iov_base = &slot->footer;
+			slot->iov[2].iov_len = slot->entry->compression == ZIP_ALG_DEFLATE ? sizeof(struct gz_footer) : 0;
+
+			sqe = uring_get_sqe(&ring);
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = zip->fd;
+			sqe->addr = (uintptr_t)slot->data;
+			sqe->len = slot->entry->zip_size;
+			sqe->off = slot->entry->offset + 30 + slot->file_entry.fname_len + slot->file_entry.extra_len;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = ((uint64_t)i << 3) | URING_READ;
+
+			sqe = uring_get_sqe(&ring);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t)slot->fname;
+			sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+			sqe->len = 0644; // mode
+			sqe->file_index = i + 1;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = ((uint64_t)i << 3) | URING_OPEN;
+
+			sqe = uring_get_sqe(&ring);
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->fd = i;
+			sqe->addr = (uintptr_t)slot->iov;
+			sqe->len = 3;
+			sqe->off = 0;
+			sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+			sqe->user_data = ((uint64_t)i << 3) | URING_WRITE;
+
+			// the close isn't part of the chain, so the slot is freed even when a step fails
+			sqe = uring_get_sqe(&ring);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->file_index = i + 1;
+			sqe->user_data = ((uint64_t)i << 3) | URING_CLOSE;
+		}
+
+		for (i = 0, used = 0; i < count; i++)
+			used += slots[i].failed ? 0 : 4;
+		if (uring_submit_and_wait(&ring, slots, used) == -1)
+		{
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			echo_name(slots[i].fname, slots[i].len);
+			if (slots[i].failed)
+			{
+				message("Could not copy %s.\n", slots[i].fname);
+				ret = -1;
+			}
+			else
+				stats_entry(slots[i].start);
+		}
+	}
+
+	uring_close(&ring);
+	free(slots);
+	free(buffer);
+
+	return ret;
+}
+#endif
+// ---------------------- io_uring extract end ------------------
+
+// Adds a copy of entry and its name to the end of table, growing it as needed
+static struct zip_entry *table_append(struct zip_table *table, uint32_t *capacity, uint64_t *names_capacity, uint64_t *names_len, struct zip_entry *entry, const unsigned char *name)
+{
+	void *p;
+
+	if (table->count == *capacity)
+	{
+		p = realloc(table->entries, sizeof(struct zip_entry) * (*capacity ? *capacity * 2 : 64));
+		if (!p)
+			return NULL;
+		table->entries = p;
+		*capacity = *capacity ? *capacity * 2 : 64;
+	}
+	if (*names_len + entry->name_len + 1 > *names_capacity)
+	{
+		p = realloc(table->names, (*names_len + entry->name_len + 1) * 2);
+		if (!p)
+			return NULL;
+		table->names = p;
+		*names_capacity = (*names_len + entry->name_len + 1) * 2;
+	}
+
+	entry->name = *names_len;
+	memcpy(table->names + *names_len, name, entry->name_len);
+	table->names[*names_len + entry->name_len] = 0;
+	*names_len += entry->name_len + 1;
+
+	table->entries[table->count] = *entry;
+	return &table->entries[table->count++];
+}
+
+// Converts a zip arriving on in_fd from front to back without ever seeking, 
+// so it can come from a pipe. Each entry is converted as soon as its local 
+// header has been read. Entries with a data descriptor don't have their 
+// sizes up front, so their data is spooled to a temporary file until the 
+// descriptor turns up. The central directory at the end is only used to 
+// check that everything converted matches it.
+static int zip_stream_convert(int in_fd, int tar_fd, uint8_t method, struct name_filter *filter)
+{
+	struct zip_stream st;
+	struct zip_local_file file_entry;
+	struct zip_directory zip_dir;
+	struct zip_table table = {0};
+	struct zip_entry entry, *e;
+	struct zip_source src;
+	struct zip_input spool = {-1, 0, NULL};
+	struct gather out;
+	FILE *spool_file = NULL;
+	unsigned char *name, *fname;
+	uint64_t names_len = 0, names_capacity = 0, header_offset, start;
+	struct tgz_state tgz;
+	uint32_t magic, capacity = 0, n;
+	int len, ret = 0, bad = 0, wanted;
+
+	// names are at most 65535 bytes, plus room for .gz
+	name = malloc(65536);
+	fname = malloc(65536 + 5);
+	if (!name || !fname || gather_init(&out, tar_fd, GATHER_BYTES) == -1)
+	{
+		free(name);
+		free(fname);
+		return -1;
+	}
+	if (stream_open(&st, in_fd) == -1)
+	{
+		gather_free(&out);
+		free(name);
+		free(fname);
+		return -1;
+	}
+	tgz_init(&tgz, method);
+
+	for (;;)
+	{
+		start = stats_now();
+		header_offset = stream_tell(&st);
+		if (stream_fill(&st, 4) < 4)
+		{
+			message("The zip file ended before its central directory.\n");
+			ret = -1;
+			break;
+		}
+		memcpy(&magic, st.buffer + st.pos, 4);
+		if (magic == ZIP_CD_MAGIC)
+			break;
+		if (magic != ZIP_FILE_MAGIC || stream_read(&st, &file_entry, 30) == -1 ||
+			stream_read(&st, name, file_entry.fname_len) == -1)
+		{
+			message("Found something that isn't a zip file entry at %llu.\n", (unsigned long long)header_offset);
+			ret = -1;
+			break;
+		}
+
+		memset(&entry, 0, sizeof(entry));
+		entry.zip_size = file_entry.zip_size;
+		entry.unzip_size = file_entry.unzip_size;
+		entry.crc32 = file_entry.crc32;
+		entry.dos_time = (uint32_t)file_entry.mdate << 16 | file_entry.mtime;
+		entry.compression = file_entry.compression;
+		entry.name_len = file_entry.fname_len;
+
+		// the extra field only matters if it has the ZIP64 sizes
+		if (stream_read(&st, fname, file_entry.extra_len) == -1 ||
+			((entry.zip_size == ZIP64_SENTINEL || entry.unzip_size == ZIP64_SENTINEL) &&
+			 zip64_read_extra(&entry, fname, file_entry.extra_len) == -1))
+		{
+			message("Damaged local header at %llu.\n", (unsigned long long)header_offset);
+			ret = -1;
+			break;
+		}
+		entry.offset = header_offset;
+
+		src.zip = NULL;
+		src.stream = &st;
+		if (file_entry.flags & ZIP_FLAG_DESCRIPTOR)
+		{
+			if (!spool_file)
+			{
+				spool_file = tmpfile();
+				spool.fd = spool_file ? fileno(spool_file) : -1;
+			}
+			if (spool.fd == -1 || lseek(spool.fd, 0, SEEK_SET) == -1 || ftruncate(spool.fd, 0) == -1 ||
+				stream_spool(&st, spool.fd, &entry, file_entry.extra_len > 0 && (file_entry.zip_size == ZIP64_SENTINEL || file_entry.unzip_size == ZIP64_SENTINEL)) == -1)
+			{
+				message("Could not find the end of the data at %llu.\n", (unsigned long long)header_offset);
+				ret = -1;
+				break;
+			}
+			spool.size = entry.zip_size;
+			src.zip = &spool;
+			src.offset = 0;
+			src.stream = NULL;
+		}
+
+		e = table_append(&table, &capacity, &names_capacity, &names_len, &entry, name);
+		if (!e)
+		{
+			ret = -1;
+			break;
+		}
+
+		// entries that aren't wanted, or whose name is too long for a 
+		// tarball, are only read past
+		len = entry_name(&table, e, method, fname, 65536 + 5);
+		wanted = filter_match(filter, table.names + e->name, e->name_len);
+		if (len == -1 || !wanted)
+		{
+			if (wanted)
+				message("Skipping a file with a name that is too long.\n");
+			if (src.stream && stream_skip(&st, e->zip_size) == -1)
+			{
+				message("The zip file ended in the middle of %s.\n", table.names + e->name);
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+		echo_name(fname, len);
+
+		switch (method)
+		{
+			case BH_MODE_MAKE_TAR:
+				ret = tar_write(fname, &src, &out, e, NULL);
+				break;
+			case BH_MODE_EXTRACT:
+				ret = gz_create(fname, &src, e);
+				break;
+			case BH_MODE_MAKE_TGZ:
+			case BH_MODE_MAKE_TGZ_SINGLE:
+				ret = tgz_write(fname, &src, &out, e, NULL, &tgz);
+				break;
+		}
+		if (ret == -1)
+		{
+			// the stream can't be picked up again after a partial entry
+			message("Could not copy %s.\n", fname);
+			break;
+		}
+		stats_entry(start);
+	}
+
+	// check everything against the central directory
+	start = stats_now();
+	for (n = 0; ret == 0; n++)
+	{
+		if (stream_fill(&st, 4) < 4)
+			break;
+		memcpy(&magic, st.buffer + st.pos, 4);
+		if (magic != ZIP_CD_MAGIC)
+			break;
+		if (stream_read(&st, &zip_dir, 46) == -1 || stream_read(&st, name, zip_dir.fname_len) == -1 ||
+			stream_read(&st, fname, zip_dir.extra_len) == -1)
+		{
+			ret = -1;
+			break;
+		}
+
+		memset(&entry, 0, sizeof(entry));
+		entry.offset = zip_dir.offset;
+		entry.zip_size = zip_dir.zip_size;
+		entry.unzip_size = zip_dir.unzip_size;
+		if (entry.offset == ZIP64_SENTINEL || entry.zip_size == ZIP64_SENTINEL || entry.unzip_size == ZIP64_SENTINEL)
+			zip64_read_extra(&entry, fname, zip_dir.extra_len);
+		// the comment isn't kept, and if the zip ends in it the next read says so
+		stream_skip(&st, zip_dir.comment_len);
+
+		e = n < table.count ? &table.entries[n] : NULL;
+		if (!e || e->name_len != zip_dir.fname_len || memcmp(table.names + e->name, name, e->name_len) != 0 ||
+			e->crc32 != zip_dir.crc32 || e->compression != zip_dir.compression ||
+			e->zip_size != entry.zip_size || e->unzip_size != entry.unzip_size)
+		{
+			message("%.*s doesn't match the central directory.\n", zip_dir.fname_len, name);
+			bad++;
+		}
+	}
+	if (ret == 0 && n != table.count)
+	{
+		message("The central directory has %u entries, but %u were converted.\n", n, table.count);
+		bad++;
+	}
+	stats_add(STAT_DIRECTORY, start, 0);
+
+	if (ret == 0 && method != BH_MODE_MAKE_TAR && method != BH_MODE_EXTRACT)
+		ret = tgz_finish(&out, &tgz);
+	else if (gather_flush(&out) == -1) // what was converted before a failure still goes out
+		ret = -1;
+
+	if (spool_file)
+		fclose(spool_file);
+	tgz_free(&tgz);
+	stream_close(&st);
+	gather_free(&out);
+	free(table.entries);
+	free(table.names);
+	free(name);
+	free(fname);
+
+	return (ret == -1 || bad) ? -1 : 0;
+}
+
+// ---------------------- verify ----------------------
+
+// --verify checks the data of every entry against the crc and size in the 
+// central directory, on its own pool of threads while the conversion runs. 
+// Stored entries only need a crc. Deflated ones have to be inflated for 
+// that, which is slow, so they're only checked with --verify=inflate.
+#define VERIFY_STORED  1
+#define VERIFY_INFLATE 2
+
+struct verify_job
+{
+	struct zip_input *zip;
+	struct zip_table *table;
+	int level;
+	int threads;
+	struct zip_stream *streams; // one per worker
+	unsigned char **windows;    // the same, for inflating
+	pthread_t thread;
+	int started;
+	int ret;
+};
+
+// Inflates one whole deflate stream from st, keeping only the crc and size 
+// of what came out, and len gets the length of the deflate stream itself. 
+// zlib's inflate() is a good deal quicker than deflate_inflate(), which is
+// only there for builds without it. window is DEFLATE_WINDOW_BUFFER bytes
+// either way, zlib gets it to inflate into.
+static int verify_inflate(struct zip_stream *st, unsigned char *window, uint64_t *len, uint32_t *crc, uint64_t *size)
+{
+#ifdef BH_ZLIB
+	z_stream z = {0};
+	size_t n;
+	int ret = Z_OK;
+
+	if (inflateInit2(&z, -15) != Z_OK)
+		return -1;
+	*crc = 0;
+	while (ret != Z_STREAM_END)
+	{
+		n = stream_fill(st, 1);
+		if (n == 0)
+			break;
+		z.next_in = st->buffer + st->pos;
+		z.avail_in = n;
+		do
+		{
+			z.next_out = window;
+			z.avail_out = DEFLATE_WINDOW_BUFFER;
+			ret = inflate(&z, Z_NO_FLUSH);
+			*crc = update_crc(*crc, window, DEFLATE_WINDOW_BUFFER - z.avail_out);
+		} while (ret == Z_OK && z.avail_out == 0);
+		st->pos += n - z.avail_in;
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			break;
+	}
+	*len = z.total_in;
+	*size = z.total_out;
+	inflateEnd(&z);
+
+	return ret == Z_STREAM_END ? 0 : -1;
+#else
+	return deflate_inflate(st, window, len, crc, size);
+#endif
+}
+
+static int verify_entry(void *arg, uint32_t index, int worker)
+{
+	struct verify_job *job = arg;
+	struct zip_entry *entry = &job->table->entries[index];
+	struct zip_stream *st = &job->streams[worker];
+	const unsigned char *name = job->table->names + entry->name;
+	const unsigned char *p;
+	const char *damage = NULL;
+	uint64_t len, size = 0;
+	uint32_t crc = 0;
+	off_t offset;
+	size_t n;
+
+	if (entry->compression == ZIP_ALG_DEFLATE && job->level < VERIFY_INFLATE)
+		return 0;
+	if (entry->compression != ZIP_ALG_STORE && entry->compression != ZIP_ALG_DEFLATE)
+		return 0;
+
+	offset = zip_data_offset(job->zip, entry);
+	if (offset == -1)
+	{
+		message("%.*s is damaged: its local header is missing.\n", entry->name_len, name);
+		return -1;
+	}
+
+	if (entry->compression == ZIP_ALG_STORE && (p = zip_input_ptr(job->zip, offset, entry->zip_size)))
+	{
+		crc = update_crc(0, p, entry->zip_size);
+		size = entry->zip_size;
+	}
+	else if (entry->compression == ZIP_ALG_STORE)
+	{
+		stream_range(st, job->zip->fd, offset, entry->zip_size);
+		while ((n = stream_fill(st, STREAM_BUFFER_SIZE)) > 0)
+		{
+			crc = update_crc(crc, st->buffer + st->pos, n);
+			st->pos += n;
+			size += n;
+		}
+		if (size != entry->zip_size)
+			damage = "the zip file ends in the middle of it";
+	}
+	else
+	{
+		// a deflate stream that doesn't end where the entry does is damaged 
+		// too, so the range is one byte longer than it should need
+		stream_range(st, job->zip->fd, offset, entry->zip_size + 1);
+		if (verify_inflate(st, job->windows[worker], &len, &crc, &size) == -1)
+			damage = "its deflate data is broken";
+		else if (len != entry->zip_size)
+			damage = "its deflate data doesn't end where the entry does";
+	}
+
+	if (!damage && size != entry->unzip_size)
+		damage = "it isn't the size the central directory says";
+	if (!damage && crc != entry->crc32)
+		damage = "its crc doesn't match";
+	if (damage)
+	{
+		message("%.*s is damaged: %s.\n", entry->name_len, name, damage);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *verify_thread(void *arg)
+{
+	struct verify_job *job = arg;
+
+	job->ret = pool_run(job->threads, job->table->count, verify_entry, job);
+
+	return NULL;
+}
+
+// Starts checking the entries of table on threads threads of its own. 
+// zip and table have to stay as they are until verify_finish().
+static int verify_start(struct verify_job *job, struct zip_input *zip, struct zip_table *table, int level, int threads)
+{
+	int i;
+
+	memset(job, 0, sizeof(struct verify_job));
+	job->zip = zip;
+	job->table = table;
+	job->level = level;
+	job->threads = threads;
+	job->streams = calloc(threads, sizeof(struct zip_stream));
+	job->windows = calloc(threads, sizeof(unsigned char *));
+	if (!job->streams || !job->windows)
+		return -1;
+	for (i = 0; i < threads; i++)
+	{
+		if (stream_open(&job->streams[i], zip->fd) == -1)
+			return -1;
+		if (level >= VERIFY_INFLATE && !(job->windows[i] = malloc(DEFLATE_WINDOW_BUFFER)))
+			return -1;
+	}
+
+	// without a thread of its own, it's done before the conversion starts
+	job->started = pthread_create(&job->thread, NULL, verify_thread, job) == 0;
+	if (!job->started)
+		verify_thread(job);
+
+	return 0;
+}
+
+// Waits for the checks to finish. Returns -1 if any entry is damaged.
+static int verify_finish(struct verify_job *job)
+{
+	int i;
+
+	if (job->started)
+		pthread_join(job->thread, NULL);
+	job->started = 0;
+
+	for (i = 0; i < job->threads; i++)
+	{
+		if (job->streams && job->streams[i].buffer)
+			stream_close(&job->streams[i]);
+		if (job->windows)
+			free(job->windows[i]);
+	}
+	free(job->streams);
+	free(job->windows);
+	job->streams = NULL;
+	job->windows = NULL;
+	job->threads = 0;
+
+	return job->ret;
+}
+
+// ---------------------- verify end ------------------
+
+// ---------------------- tar to zip ----------------------
+
+// What's needed from a tar header. name points at a buffer of 65536 bytes, 
+// which may already hold a name from a GNU long name record (name_len > 0).
+struct tar_entry
+{
+	unsigned char *name;
+	uint32_t name_len;
+	uint64_t size;
+	time_t mtime;
+	unsigned char type;
+	const unsigned char *link; // the linkname of a hard link, in the header
+	uint32_t link_len;
+};
+
+// Reads an octal tar field, which can be padded with spaces or NULs
+static uint64_t tar_octal(const unsigned char *field, int len)
+{
+	uint64_t n = 0;
+	int i = 0;
+
+	while (i < len && field[i] == ' ')
+		i++;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		n = (n << 3) | (field[i] - '0');
+
+	return n;
+}
+
+// The size of a tar entry, in octal or GNU base-256 (see tar_set_size())
+static uint64_t tar_get_size(const struct tar_posix_header *header)
+{
+	uint64_t size;
+	int i;
+
+	if (!(header->size[0] & 0x80))
+		return tar_octal(header->size, sizeof(header->size));
+
+	size = header->size[0] & 0x7f;
+	for (i = 1; i < (int)sizeof(header->size); i++)
+		size = (size << 8) | header->size[i];
+
+	return size;
+}
+
+// Decodes a tar header into t. Returns 1 for a header, 0 for the zero block 
+// that ends the archive, and -1 for anything that isn't a tar header.
+static int tar_read_header(const struct tar_posix_header *header, struct tar_entry *t)
+{
+	const unsigned char *p = (const unsigned char *)header;
+	uint32_t sum = 0, len;
+	int i;
+
+	for (i = 0; i < 512; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : p[i];
+	if (sum == 8 * ' ')
+		return 0;
+	if (sum != tar_octal(header->chksum, sizeof(header->chksum)))
+		return -1;
+
+	t->size = tar_get_size(header);
+	t->mtime = tar_octal(header->mtime, sizeof(header->mtime));
+	t->type = header->typeflag;
+	t->link = header->linkname;
+	t->link_len = strnlen((const char *)header->linkname, sizeof(header->linkname));
+
+	if (t->name_len > 0)
+		return 1;
+
+	// POSIX ustar puts the start of long names in prefix
+	len = 0;
+	if (memcmp(header->magic, "ustar\0", 6) == 0 && header->prefix[0])
+	{
+		len = strnlen((const char *)header->prefix, sizeof(header->prefix));
+		memcpy(t->name, header->prefix, len);
+		t->name[len++] = '/';
+	}
+	i = strnlen((const char *)header->name, sizeof(header->name));
+	memcpy(t->name + len, header->name, i);
+	t->name_len = len + i;
+
+	return 1;
+}
+
+// Unix time to the MS-DOS date and time zip uses, date in the top half. 
+// MS-DOS time starts in 1980, anything older gets the first day of 1980.
+static uint32_t dos_time(time_t t)
+{
+	struct tm tm;
+
+	if (t < 315532800 || !localtime_r(&t, &tm) || tm.tm_year < 80)
+		return (1 << 5 | 1) << 16;
+
+	return (uint32_t)((tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday) << 16 |
+		(tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2);
+}
+
+// Writes the local header of entry. Its crc and sizes aren't known until 
+// its data has gone past, so they come after it, in a data descriptor.
+// Returns the length of the header, or -1.
+static int zip_write_local(struct gather *out, struct zip_entry *entry, const unsigned char *name, int zip64)
+{
+	struct zip_local_file header = {0};
+	struct zip64_extra extra = {0};
+
+	header.magic = ZIP_FILE_MAGIC;
+	header.min_version = zip64 ? 45 : 20;
+	header.flags = ZIP_FLAG_DESCRIPTOR;
+	header.compression = entry->compression;
+	header.mtime = entry->dos_time & 0xffff;
+	header.mdate = entry->dos_time >> 16;
+	header.fname_len = entry->name_len;
+
+	// the descriptor of a ZIP64 entry has 8 byte sizes, which the extra field
+	// has to announce even though its own sizes are left at 0
+	if (zip64)
+	{
+		header.zip_size = ZIP64_SENTINEL;
+		header.unzip_size = ZIP64_SENTINEL;
+		header.extra_len = 4 + 16;
+		extra.id = ZIP64_EXTRA_ID;
+		extra.len = 16;
+	}
+
+	if (gather_copy(out, &header, 30) == -1 ||
+		gather_copy(out, name, entry->name_len) == -1 ||
+		gather_copy(out, &extra, header.extra_len) == -1)
+		return -1;
+
+	return 30 + entry->name_len + header.extra_len;
+}
+
+// Writes the data descriptor that goes after the data of entry. Returns its
+// length, or -1.
+static int zip_write_descriptor(struct gather *out, struct zip_entry *entry, int zip64)
+{
+	struct zip_descriptor d = {ZIP_DESCRIPTOR_MAGIC, entry->crc32, entry->zip_size, entry->unzip_size};
+	struct zip64_descriptor d64 = {ZIP_DESCRIPTOR_MAGIC, entry->crc32, entry->zip_size, entry->unzip_size};
+
+	if (zip64)
+		return gather_copy(out, &d64, sizeof(d64)) == -1 ? -1 : (int)sizeof(d64);
+
+	if (entry->zip_size >= ZIP64_SENTINEL || entry->unzip_size >= ZIP64_SENTINEL)
+		return -1;
+	return gather_copy(out, &d, sizeof(d)) == -1 ? -1 : (int)sizeof(d);
+}
+
+// Writes the central directory for table, and the end of central directory 
+// records after it. offset is where the directory starts in the zip.
+static int zip_write_directory(struct gather *out, struct zip_table *table, uint64_t offset)
+{
+	struct zip_directory dir;
+	struct zip64_extra extra;
+	struct zip_eocd eocd = {0};
+	struct zip64_eocd eocd64 = {0};
+	struct zip64_eocd_locator locator = {0};
+	struct zip_entry *entry;
+	uint64_t size = 0;
+	uint32_t n;
+	int k;
+
+	for (n = 0; n < table->count; n++)
+	{
+		entry = &table->entries[n];
+		memset(&dir, 0, sizeof(dir));
+		memset(&extra, 0, sizeof(extra));
+		dir.magic = ZIP_CD_MAGIC;
+		dir.flags = ZIP_FLAG_DESCRIPTOR;
+		dir.compression = entry->compression;
+		dir.mtime = entry->dos_time & 0xffff;
+		dir.mdate = entry->dos_time >> 16;
+		dir.crc32 = entry->crc32;
+		dir.fname_len = entry->name_len;
+		dir.eattr = entry->name_len > 0 && table->names[entry->name + entry->name_len - 1] == '/' ? 0x10 : 0; // MS-DOS directory
+
+		// whatever doesn't fit moves to the ZIP64 extra field, in this order
+		k = 0;
+		dir.unzip_size = entry->unzip_size < ZIP64_SENTINEL ? entry->unzip_size : ZIP64_SENTINEL;
+		if (dir.unzip_size == ZIP64_SENTINEL)
+			extra.values[k++] = entry->unzip_size;
+		dir.zip_size = entry->zip_size < ZIP64_SENTINEL ? entry->zip_size : ZIP64_SENTINEL;
+		if (dir.zip_size == ZIP64_SENTINEL)
+			extra.values[k++] = entry->zip_size;
+		dir.offset = entry->offset < ZIP64_SENTINEL ? entry->offset : ZIP64_SENTINEL;
+		if (dir.offset == ZIP64_SENTINEL)
+			extra.values[k++] = entry->offset;
+		extra.id = ZIP64_EXTRA_ID;
+		extra.len = k * 8;
+		dir.extra_len = extra.len ? 4 + extra.len : 0;
+		dir.version = dir.min_version = extra.len ? 45 : 20;
+
+		if (gather_copy(out, &dir, 46) == -1 ||
+			gather_copy(out, table->names + entry->name, entry->name_len) == -1 ||
+			gather_copy(out, &extra, dir.extra_len) == -1)
+			return -1;
+		size += 46 + entry->name_len + dir.extra_len;
+	}
+
+	eocd.magic = ZIP_EOCD_MAGIC;
+	eocd.central_records = table->count < 0xFFFF ? table->count : 0xFFFF;
+	eocd.total_central_records = eocd.central_records;
+	eocd.central_dir_size = size < ZIP64_SENTINEL ? size : ZIP64_SENTINEL;
+	eocd.central_dir_offset = offset < ZIP64_SENTINEL ? offset : ZIP64_SENTINEL;
+
+	if (eocd.central_records == 0xFFFF || eocd.central_dir_size == ZIP64_SENTINEL || eocd.central_dir_offset == ZIP64_SENTINEL)
+	{
+		eocd64.magic = ZIP64_EOCD_MAGIC;
+		eocd64.eocd_size = sizeof(eocd64) - 12;
+		eocd64.version = 45;
+		eocd64.min_version = 45;
+		eocd64.central_records = table->count;
+		eocd64.total_central_records = table->count;
+		eocd64.central_dir_size = size;
+		eocd64.central_dir_offset = offset;
+
+		locator.magic = ZIP64_LOCATOR_MAGIC;
+		locator.eocd_offset = offset + size;
+		locator.total_disks = 1;
+
+		if (gather_copy(out, &eocd64, sizeof(eocd64)) == -1 ||
+			gather_copy(out, &locator, sizeof(locator)) == -1)
+			return -1;
+	}
+
+	return gather_copy(out, &eocd, 22);
+}
+
+// Reads a gzip member header, skipping whatever optional fields it has. 
+// Returns its length, or -1 if it isn't the header of a deflate member.
+static int gz_read_header(struct zip_stream *st)
+{
+	struct gz_header header;
+	unsigned char b[2];
+	int len = sizeof(struct gz_header);
+	uint8_t flag;
+
+	if (stream_read(st, &header, sizeof(header)) == -1 || header.magic != GZ_MAGIC ||
+		header.method != GZ_METHOD_DEFLATE || (header.flags & GZ_FLAGS_RESTRICTED))
+		return -1;
+
+	if (header.flags & GZ_FLAGS_EXTRA)
+	{
+		if (stream_read(st, b, 2) == -1 || stream_skip(st, b[0] | b[1] << 8) == -1)
+			return -1;
+		len += 2 + (b[0] | b[1] << 8);
+	}
+
+	// 0x08 and 0x10 are a file name and a comment (FNAME and FCOMMENT in 
+	// RFC 1952), both zero terminated
+	for (flag = GZ_FLAGS_NAME_TRUNC; flag <= GZ_FLAGS_ENCRYPTED; flag <<= 1)
+		if (header.flags & flag)
+			do
+			{
+				if (stream_read(st, b, 1) == -1)
+					return -1;
+				len++;
+			} while (b[0] != 0);
+
+	if (header.flags & GZ_FLAGS_HEADER_CRC)
+	{
+		if (stream_skip(st, 2) == -1)
+			return -1;
+		len += 2;
+	}
+
+	return len;
+}
+
+// Passes the next len bytes of st on to out, and works out their crc 
+// on the way.
+static int stream_gather_crc(struct zip_stream *st, struct gather *out, uint64_t len, uint32_t *crc32)
+{
+	size_t n;
+
+	*crc32 = 0;
+	while (len > 0)
+	{
+		n = stream_fill(st, 1);
+		if (n == 0)
+			return -1;
+		if (n > len)
+			n = len;
+		*crc32 = update_crc(*crc32, st->buffer + st->pos, n);
+		if (gather_copy(out, st->buffer + st->pos, n) == -1)
+			return -1;
+		st->pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// A deflate stream is never much bigger than the data in it. An entry that 
+// could come near 4 GiB gets ZIP64 sizes in its data descriptor.
+static inline int zip64_needed(uint64_t size)
+{
+	return size + (size >> 10) + 1024 >= ZIP64_SENTINEL;
+}
+
+// A hard link (from --dedup) has no data of its own. Its zip entry gets a 
+// copy of the data of the entry it links to, read again from the tarball,
+// so that only works when the tarball is a file.
+struct tar_links
+{
+	struct zip_input tar; // fd is -1 when the tarball is a pipe
+	off_t base; // where the tarball starts in the file
+	uint64_t *data; // where the data of each entry of the table is in the tarball
+	uint32_t capacity;
+};
+
+// Remembers that the data of entry n of the table is at offset in the tarball
+static int tar_links_add(struct tar_links *links, uint32_t n, uint64_t offset)
+{
+	void *p;
+
+	if (n >= links->capacity)
+	{
+		p = realloc(links->data, sizeof(uint64_t) * (n + 64) * 2);
+		if (!p)
+			return -1;
+		links->data = p;
+		links->capacity = (n + 64) * 2;
+	}
+	links->data[n] = offset;
+
+	return 0;
+}
+
+// Adds the hard link t to the table, as a copy of the latest entry called 
+// its linkname. In a plain tarball a deflated entry has lost the .gz on the
+// end of its name, which the link loses as well.
+static int tar_link(struct tar_links *links, struct gather *out, struct zip_table *table, uint32_t *capacity, uint64_t *names_capacity, uint64_t *names_len, struct tar_entry *t, uint64_t *pos, int plain)
+{
+	struct zip_entry entry, *e;
+	struct zip_source src = {&links->tar, 0, NULL};
+	uint32_t n, gz = 0;
+	int len, zip64;
+
+	for (n = table->count; n-- > 0;)
+	{
+		e = &table->entries[n];
+		gz = plain && e->compression == ZIP_ALG_DEFLATE ? 3 : 0;
+		if (e->name_len + gz == t->link_len && memcmp(table->names + e->name, t->link, e->name_len) == 0 &&
+			memcmp(t->link + e->name_len, ".gz", gz) == 0)
+			break;
+	}
+	if (n >= table->count)
+	{
+		message("%.*s links to %.*s, which isn't in the tarball.\n", (int)t->name_len, t->name, (int)t->link_len, t->link);
+		return -1;
+	}
+	if (links->tar.fd == -1)
+	{
+		message("%.*s is a hard link, which can't be copied out of a pipe.\n", (int)t->name_len, t->name);
+		return -1;
+	}
+
+	entry = table->entries[n];
+	entry.offset = *pos;
+	entry.dos_time = dos_time(t->mtime);
+	entry.name_len = t->name_len;
+	entry.link = 0;
+	if (gz && t->name_len > 3 && memcmp(t->name + t->name_len - 3, ".gz", 3) == 0)
+		entry.name_len -= 3;
+	src.offset = links->base + links->data[n];
+	if (tar_links_add(links, table->count, links->data[n]) == -1)
+		return -1;
+	e = table_append(table, capacity, names_capacity, names_len, &entry, t->name);
+	if (!e)
+		return -1;
+	echo_name(table->names + e->name, e->name_len);
+
+	zip64 = zip64_needed(e->zip_size) || zip64_needed(e->unzip_size);
+	if ((len = zip_write_local(out, e, t->name, zip64)) == -1 || gather_source(out, &src, e->zip_size) == -1)
+		return -1;
+	*pos += len + e->zip_size;
+	if ((len = zip_write_descriptor(out, e, zip64)) == -1)
+		return -1;
+	*pos += len;
+
+	return 0;
+}
+
+// Converts a plain tarball (of gzipped files, as made by -c) back into a 
+// zip. A .gz file has its deflate data moved into the zip as it is, with the
+// crc and size from its gzip footer, and every other file is stored.
+static int tar_to_zip_plain(struct zip_stream *st, struct gather *out, struct zip_table *table, struct tar_links *links)
+{
+	struct tar_posix_header header;
+	struct tar_entry t = {0};
+	struct zip_entry entry, *e;
+	struct zip_source src = {NULL, 0, st};
+	struct gz_footer footer;
+	uint64_t pos = 0, names_len = 0, names_capacity = 0, start;
+	uint32_t capacity = 0;
+	int len, ret, gz, zip64;
+
+	t.name = malloc(65536 + 1);
+	if (!t.name)
+		return -1;
+
+	for (;;)
+	{
+		start = stats_now();
+		if (stream_fill(st, 512) == 0) // a tarball missing its zero blocks
+			break;
+		if (stream_read(st, &header, 512) == -1 || (ret = tar_read_header(&header, &t)) == -1)
+		{
+			message("This does not appear to be a tar file.\n");
+			goto fail;
+		}
+		if (ret == 0)
+			break;
+
+		// GNU long names come in a record of their own, before the real header
+		if (t.type == 'L')
+		{
+			if (t.size > 65536 || stream_read(st, t.name, t.size) == -1 ||
+				stream_skip(st, (512 - t.size % 512) % 512) == -1)
+				goto fail;
+			t.name_len = strnlen((const char *)t.name, t.size);
+			continue;
+		}
+		if (t.type == '5' && t.name_len > 0 && t.name_len < 65535 && t.name[t.name_len - 1] != '/')
+			t.name[t.name_len++] = '/';
+
+		if (t.type == '1' && t.name_len > 0 && t.name_len <= 65535)
+		{
+			if (tar_link(links, out, table, &capacity, &names_capacity, &names_len, &t, &pos, 1) == -1 ||
+				stream_skip(st, t.size + (512 - t.size % 512) % 512) == -1)
+				goto fail;
+			t.name_len = 0;
+			stats_entry(start);
+			continue;
+		}
+
+		if ((t.type != '0' && t.type != 0 && t.type != '7' && t.type != '5') || t.name_len == 0 || t.name_len > 65535)
+		{
+			message("Skipping %.*s, it isn't a file.\n", (int)t.name_len, t.name);
+			if (stream_skip(st, t.size + (512 - t.size % 512) % 512) == -1)
+				goto fail;
+			t.name_len = 0;
+			continue;
+		}
+
+		gz = t.type != '5' && t.name_len > 3 && memcmp(t.name + t.name_len - 3, ".gz", 3) == 0 &&
+			t.size >= sizeof(struct gz_header) + sizeof(struct gz_footer) && stream_fill(st, 3) >= 3 &&
+			memcmp(st->buffer + st->pos, "\x1f\x8b\x08", 3) == 0;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.offset = pos;
+		entry.dos_time = dos_time(t.mtime);
+		entry.name_len = gz ? t.name_len - 3 : t.name_len;
+		entry.compression = gz ? ZIP_ALG_DEFLATE : ZIP_ALG_STORE;
+		e = table_append(table, &capacity, &names_capacity, &names_len, &entry, t.name);
+		if (!e)
+			goto fail;
+		echo_name(table->names + e->name, e->name_len);
+
+		if (gz)
+		{
+			// the size of the deflate data is known, but not of what's in it
+			len = gz_read_header(st);
+			if (len == -1 || (uint64_t)len + sizeof(struct gz_footer) > t.size)
+			{
+				message("%.*s is a damaged gzip file.\n", (int)t.name_len, t.name);
+				goto fail;
+			}
+			e->zip_size = t.size - len - sizeof(struct gz_footer);
+			zip64 = zip64_needed(e->zip_size);
+			if (tar_links_add(links, e - table->entries, stream_tell(st)) == -1 ||
+				(len = zip_write_local(out, e, t.name, zip64)) == -1 ||
+				gather_source(out, &src, e->zip_size) == -1 ||
+				stream_read(st, &footer, sizeof(footer)) == -1)
+				goto fail;
+			// gzip only keeps the size modulo 4 GiB
+			e->crc32 = footer.crc;
+			e->unzip_size = footer.isize;
+		}
+		else
+		{
+			e->zip_size = e->unzip_size = t.type == '5' ? 0 : t.size;
+			zip64 = zip64_needed(e->zip_size);
+			if (tar_links_add(links, e - table->entries, stream_tell(st)) == -1 ||
+				(len = zip_write_local(out, e, t.name, zip64)) == -1 ||
+				stream_gather_crc(st, out, e->zip_size, &e->crc32) == -1)
+				goto fail;
+		}
+		pos += len + e->zip_size;
+
+		// a directory's size should be 0, but its data is skipped if it isn't
+		len = zip_write_descriptor(out, e, zip64);
+		if (len == -1 || stream_skip(st, (t.type == '5' ? t.size : 0) + (512 - t.size % 512) % 512) == -1)
+			goto fail;
+		pos += len;
+		t.name_len = 0;
+		stats_entry(start);
+	}
+
+	free(t.name);
+	return zip_write_directory(out, table, pos);
+
+fail:
+	free(t.name);
+	return -1;
+}
+
+// Converts a gzipped tarball made by -z back into a zip. Every entry is a 
+// gzip member of its own, starting with a stored block that holds the 
+// padding of the entry before it and the tar header, followed by the 
+// entry's deflate stream as it was in the zip. The deflate stream has to be
+// decoded to find its end, but nothing is decompressed. Its crc is taken out
+// of the member's crc, which covers the stored block as well.
+static int tar_to_zip_gzipped(struct zip_stream *st, struct gather *out, struct zip_table *table, struct tar_links *links)
+{
+	unsigned char *block;
+	struct deflate_store_header store_header;
+	struct tar_entry t = {0};
+	struct zip_entry entry, *e;
+	struct gz_footer footer;
+	uint64_t pos = 0, names_len = 0, names_capacity = 0, data_len, start;
+	uint32_t capacity = 0, off, block_crc;
+	int len, ret = -1, zip64, dir;
+
+	block = malloc(DEFLATE_STORED_MAX);
+	t.name = malloc(65536 + 1);
+	if (!block || !t.name)
+		goto fail;
+
+	for (;;)
+	{
+		start = stats_now();
+		if (gz_read_header(st) == -1 || stream_read(st, &store_header, sizeof(store_header)) == -1 ||
+			(store_header.method & ~DEFLATE_FINAL) != DEFLATE_STORED ||
+			(store_header.inverse_size ^ store_header.block_size) != 0xffff ||
+			stream_read(st, block, store_header.block_size) == -1)
+		{
+			message("This is not a gzipped tarball made by baghand -z.\n");
+			goto fail;
+		}
+
+		// the padding is whatever comes before the whole blocks
+		ret = -1;
+		t.name_len = 0;
+		for (off = store_header.block_size % 512; off + 512 <= store_header.block_size;)
+		{
+			ret = tar_read_header((struct tar_posix_header *)(block + off), &t);
+			off += 512;
+			if (ret != 1 || t.type != 'L')
+				break;
+			if (t.size > 65536 || t.size > store_header.block_size - off)
+			{
+				ret = -1;
+				break;
+			}
+			memcpy(t.name, block + off, t.size);
+			t.name_len = strnlen((const char *)t.name, t.size);
+			off += t.size + (512 - t.size % 512) % 512;
+		}
+		if (ret == -1)
+		{
+			message("This does not appear to be a tar file.\n");
+			goto fail;
+		}
+		block_crc = crc(block, store_header.block_size);
+
+		// the last member only has the zero blocks in it
+		if (ret == 0)
+		{
+			if (!(store_header.method & DEFLATE_FINAL) || stream_read(st, &footer, sizeof(footer)) == -1 ||
+				footer.crc != block_crc)
+				goto fail;
+			break;
+		}
+		if (off != store_header.block_size || (store_header.method & DEFLATE_FINAL) || t.name_len == 0 || t.name_len > 65535)
+			goto fail;
+
+		// hard links (from --dedup) and the like have no data of their own
+		if (t.type != '0' && t.type != 0 && t.type != '7' && t.type != '5')
+		{
+			if (t.type != '1')
+				message("Skipping %.*s, it isn't a file.\n", (int)t.name_len, t.name);
+			if (deflate_scan(st, NULL, &data_len) == -1 || stream_read(st, &footer, sizeof(footer)) == -1 ||
+				(t.type == '1' && tar_link(links, out, table, &capacity, &names_capacity, &names_len, &t, &pos, 0) == -1))
+				goto fail;
+			if (t.type == '1')
+				stats_entry(start);
+			continue;
+		}
+
+		dir = t.type == '5' || t.name[t.name_len - 1] == '/';
+		if (t.type == '5' && t.name[t.name_len - 1] != '/' && t.name_len < 65535)
+			t.name[t.name_len++] = '/';
+
+		memset(&entry, 0, sizeof(entry));
+		entry.offset = pos;
+		entry.dos_time = dos_time(t.mtime);
+		entry.name_len = t.name_len;
+		entry.unzip_size = dir ? 0 : t.size;
+		entry.compression = dir ? ZIP_ALG_STORE : ZIP_ALG_DEFLATE;
+		e = table_append(table, &capacity, &names_capacity, &names_len, &entry, t.name);
+		if (!e)
+			goto fail;
+		echo_name(table->names + e->name, e->name_len);
+
+		// directories are stored empty, the deflate stream they have is dropped
+		zip64 = zip64_needed(e->unzip_size);
+		if (tar_links_add(links, e - table->entries, stream_tell(st)) == -1 ||
+			(len = zip_write_local(out, e, t.name, zip64)) == -1 ||
+			deflate_scan(st, dir ? NULL : out, &data_len) == -1 ||
+			stream_read(st, &footer, sizeof(footer)) == -1)
+		{
+			message("%.*s is damaged.\n", (int)t.name_len, t.name);
+			goto fail;
+		}
+		// a single member (-Z) only has its footer at the very end
+		if (footer.isize != (uint32_t)(store_header.block_size + t.size))
+		{
+			message("This is not a gzipped tarball made by baghand -z.\n");
+			goto fail;
+		}
+		e->zip_size = dir ? 0 : data_len;
+		e->crc32 = dir ? 0 : footer.crc ^ crc_combine(block_crc, 0, t.size);
+		pos += len + e->zip_size;
+
+		len = zip_write_descriptor(out, e, zip64);
+		if (len == -1)
+			goto fail;
+		pos += len;
+		stats_entry(start);
+	}
+
+	free(block);
+	free(t.name);
+	return zip_write_directory(out, table, pos);
+
+fail:
+	free(block);
+	free(t.name);
+	return -1;
+}
+
+// Turns a tarball arriving on tar_fd back into a zip on zip_fd, reading and
+// writing front to back so that either one can be a pipe. Whether the 
+// tarball is gzipped as a whole is told by its first two bytes.
+static int tar_to_zip(int tar_fd, int zip_fd)
+{
+	struct zip_stream st;
+	struct gather out;
+	struct zip_table table = {0};
+	struct tar_links links = {{-1, 0, NULL}, 0, NULL, 0};
+	struct stat sb;
+	int ret;
+
+	// hard links are copied from the tarball again, if it's a file
+	if (fstat(tar_fd, &sb) == 0 && S_ISREG(sb.st_mode) && (links.base = lseek(tar_fd, 0, SEEK_CUR)) != -1)
+	{
+		links.tar.fd = tar_fd;
+		links.tar.size = sb.st_size;
+	}
+
+	if (stream_open(&st, tar_fd) == -1)
+		return -1;
+	if (gather_init(&out, zip_fd, GATHER_BYTES) == -1)
+	{
+		stream_close(&st);
+		return -1;
+	}
+
+	if (stream_fill(&st, 2) >= 2 && st.buffer[0] == 0x1f && st.buffer[1] == 0x8b)
+		ret = tar_to_zip_gzipped(&st, &out, &table, &links);
+	else
+		ret = tar_to_zip_plain(&st, &out, &table, &links);
+	if (gather_flush(&out) == -1)
+		ret = -1;
+
+	gather_free(&out);
+	stream_close(&st);
+	free(table.entries);
+	free(table.names);
+	free(links.data);
+
+	return ret;
+}
+
+// ---------------------- tar to zip end ------------------
+
+// ---------------------- library interface ----------------------
+
+struct bh_archive
+{
+	struct zip_input zip;
+	struct zip_table table;
+	struct verify_job verify;
+	struct zip_base base;
+	int order; // BH_ORDER_
+	uint32_t *read_order; // for BH_ORDER_READ, see table_physical_order()
+};
+
+struct bh_filter
+{
+	struct name_filter filter;
+	int include_capacity, exclude_capacity;
+};
+
+const char *bh_strerror(int error)
+{
+	switch (error)
+	{
+		case BH_OK:
+			return "no error";
+		case BH_ERR_IO:
+			return "reading or writing failed";
+		case BH_ERR_MEMORY:
+			return "out of memory";
+		case BH_ERR_NOT_ZIP:
+			return "not a zip file";
+		case BH_ERR_DAMAGED:
+			return "damaged";
+		case BH_ERR_ARGUMENT:
+			return "invalid argument";
+		case BH_ERR_NAME:
+			return "bad or missing name";
+		default:
+			return "unknown error";
+	}
+}
+
+// Opens the zip at path into a and loads its central directory
+static int archive_open(struct bh_archive *a, const char *path, int flags)
+{
+	struct zip_eocd zip_footer = {0};
+	struct zip64_eocd zip64_footer;
+	off_t eocd_offset;
+	uint64_t start;
+
+	memset(a, 0, sizeof(struct bh_archive));
+	if (zip_input_open(&a->zip, path, flags & BH_OPEN_MMAP) == -1)
+		return BH_ERR_IO;
+
+	// Locate the End of Central Directory header (located at the end of the file)
+	start = stats_now();
+	eocd_offset = zip_locate_eocd(&a->zip, &zip_footer);
+	stats_add(STAT_EOCD, start, eocd_offset == -1 ? 0 : a->zip.size - eocd_offset);
+	if (eocd_offset == -1)
+	{
+		zip_input_close(&a->zip);
+		return BH_ERR_NOT_ZIP;
+	}
+
+	// Read all the Central Directories in one go
+	start = stats_now();
+	if (zip_read_zip64_eocd(&a->zip, eocd_offset, &zip_footer, &zip64_footer) == -1 ||
+		zip_load_table(&a->zip, &zip64_footer, &a->table) == -1)
+	{
+		zip_input_close(&a->zip);
+		return BH_ERR_DAMAGED;
+	}
+	stats_add(STAT_DIRECTORY, start, zip64_footer.central_dir_size);
+
+	return BH_OK;
+}
+
+static void base_close(struct zip_base *base)
+{
+	if (!base->offsets)
+		return;
+	free(base->offsets);
+	base->offsets = NULL;
+	zip_input_close(&base->tar);
+}
+
+static void archive_close(struct bh_archive *a)
+{
+	free(a->read_order);
+	base_close(&a->base);
+	verify_finish(&a->verify);
+	zip_free_table(&a->table);
+	zip_input_close(&a->zip);
+}
+
+int bh_open(struct bh_archive **archive, const char *path, int flags)
+{
+	int ret;
+
+	*archive = malloc(sizeof(struct bh_archive));
+	if (!*archive)
+		return BH_ERR_MEMORY;
+
+	ret = archive_open(*archive, path, flags);
+	if (ret != BH_OK)
+	{
+		free(*archive);
+		*archive = NULL;
+	}
+
+	return ret;
+}
+
+void bh_close(struct bh_archive *archive)
+{
+	if (!archive)
+		return;
+	archive_close(archive);
+	free(archive);
+}
+
+uint32_t bh_count(struct bh_archive *archive)
+{
+	return archive->table.count;
+}
+
+int bh_entry(struct bh_archive *archive, uint32_t index, struct bh_entry *entry)
+{
+	struct zip_entry *e;
+
+	if (index >= archive->table.count)
+		return BH_ERR_ARGUMENT;
+
+	e = &archive->table.entries[index];
+	entry->index = index;
+	entry->name = (const char *)archive->table.names + e->name;
+	entry->name_len = e->name_len;
+	entry->compression = e->compression;
+	entry->crc32 = e->crc32;
+	entry->dos_time = e->dos_time;
+	entry->zip_size = e->zip_size;
+	entry->unzip_size = e->unzip_size;
+	entry->offset = e->offset;
+
+	return BH_OK;
+}
+
+int bh_next(struct bh_archive *archive, uint32_t *cursor, struct bh_entry *entry)
+{
+	if (bh_entry(archive, *cursor, entry) != BH_OK)
+		return 0;
+	(*cursor)++;
+	return 1;
+}
+
+int bh_filter_new(struct bh_filter **filter)
+{
+	*filter = calloc(1, sizeof(struct bh_filter));
+	return *filter ? BH_OK : BH_ERR_MEMORY;
+}
+
+// Appends a copy of glob to a growing array of them
+static int filter_add_glob(char ***globs, int *count, int *capacity, const char *glob)
+{
+	char **p;
+
+	if (*count == *capacity)
+	{
+		p = realloc(*globs, sizeof(char *) * (*capacity ? *capacity * 2 : 8));
+		if (!p)
+			return BH_ERR_MEMORY;
+		*globs = p;
+		*capacity = *capacity ? *capacity * 2 : 8;
+	}
+	(*globs)[*count] = strdup(glob);
+	if (!(*globs)[*count])
+		return BH_ERR_MEMORY;
+	(*count)++;
+
+	return BH_OK;
+}
+
+int bh_filter_include(struct bh_filter *filter, const char *glob)
+{
+	return filter_add_glob(&filter->filter.include, &filter->filter.include_count, &filter->include_capacity, glob);
+}
+
+int bh_filter_exclude(struct bh_filter *filter, const char *glob)
+{
+	return filter_add_glob(&filter->filter.exclude, &filter->filter.exclude_count, &filter->exclude_capacity, glob);
+}
+
+int bh_filter_list(struct bh_filter *filter, const char *path)
+{
+	// the hash table is rebuilt over the longer list when it's next used
+	free(filter->filter.slots);
+	filter->filter.slots = NULL;
+	return filter_read_list(&filter->filter, path) == -1 ? BH_ERR_IO : BH_OK;
+}
+
+void bh_filter_free(struct bh_filter *filter)
+{
+	int i;
+
+	if (!filter)
+		return;
+	for (i = 0; i < filter->filter.include_count; i++)
+		free(filter->filter.include[i]);
+	for (i = 0; i < filter->filter.exclude_count; i++)
+		free(filter->filter.exclude[i]);
+	free(filter->filter.include);
+	free(filter->filter.exclude);
+	filter_free(&filter->filter);
+	free(filter);
+}
+
+// The name_filter of filter, with the hash table over its list built
+static struct name_filter *filter_ready(struct bh_filter *filter)
+{
+	if (!filter)
+		return NULL;
+	if (!filter->filter.slots && filter_build(&filter->filter) == -1)
+		return NULL;
+	return &filter->filter;
+}
+
+int bh_select(struct bh_archive *archive, struct bh_filter *filter)
+{
+	struct name_filter *f = filter_ready(filter);
+
+	if (!f)
+		return filter ? BH_ERR_MEMORY : BH_ERR_ARGUMENT;
+	if (filter_active(f))
+	{
+		zip_filter_table(&archive->table, f);
+		base_close(&archive->base); // it went by index
+		if (archive->read_order)
+		{
+			free(archive->read_order);
+			archive->read_order = table_physical_order(&archive->table);
+			if (!archive->read_order)
+				return BH_ERR_MEMORY;
+		}
+	}
+
+	return BH_OK;
+}
+
+int bh_order(struct bh_archive *archive, int order)
+{
+	free(archive->read_order);
+	archive->read_order = NULL;
+	archive->order = BH_ORDER_DIRECTORY;
+
+	switch (order)
+	{
+		case BH_ORDER_DIRECTORY:
+			break;
+		case BH_ORDER_PHYSICAL:
+			if (zip_sort_table(&archive->table) == -1)
+				return BH_ERR_MEMORY;
+			base_close(&archive->base); // it went by index
+			break;
+		case BH_ORDER_READ:
+			archive->read_order = table_physical_order(&archive->table);
+			if (!archive->read_order)
+				return BH_ERR_MEMORY;
+			break;
+		default:
+			return BH_ERR_ARGUMENT;
+	}
+	archive->order = order;
+
+	return BH_OK;
+}
+
+int bh_dedup(struct bh_archive *archive)
+{
+	return zip_dedup_table(&archive->zip, &archive->table) == -1 ? BH_ERR_IO : BH_OK;
+}
+
+int bh_base(struct bh_archive *archive, const char *tar_path, int flags, uint32_t *reused)
+{
+	int64_t count;
+
+	base_close(&archive->base);
+	count = index_base(&archive->base, tar_path, flags & BH_OPEN_MMAP, &archive->table);
+	if (count == -1)
+		return BH_ERR_IO;
+	if (reused)
+		*reused = count;
+
+	return BH_OK;
+}
+
+// Converts every entry of archive into out, one after the other
+static int convert_table(struct bh_archive *archive, int mode, struct gather *out)
+{
+	struct zip_table *table = &archive->table;
+	struct zip_entry *entry;
+	struct zip_source src;
+	unsigned char fname[512], lname[512], *link;
+	struct tgz_state tgz;
+	struct read_ahead ahead = {0, 0, 0};
+	uint32_t n;
+	uint64_t start;
+	int len, ret;
+
+	tgz_init(&tgz, mode);
+	ret = BH_OK;
+	for (n = 0; n < table->count && ret == BH_OK; n++)
+	{
+		start = stats_now();
+		// a tarball that has to be written front to back in directory 
+		// order gets its entries read that way too, but still ahead of time
+		if (archive->order != BH_ORDER_DIRECTORY)
+			read_ahead(&ahead, &archive->zip, table, NULL, n);
+		entry = &table->entries[n];
+		len = entry_name(table, entry, mode, fname, sizeof(fname));
+		if (len == -1)
+		{
+			message("Skipping a file with a name that is too long.\n");
+			continue;
+		}
+		echo_name(fname, len);
+
+		link = entry_link(table, entry, mode, lname, sizeof(lname));
+		if (!link && base_source_entry(&src, &archive->base, &archive->zip, table, n) == -1)
+		{
+			message("Could not find %s in the zip file.\n", fname);
+			ret = BH_ERR_DAMAGED;
+			break;
+		}
+
+		if (mode == BH_MODE_MAKE_TAR)
+			ret = tar_write(fname, &src, out, entry, link);
+		else
+			ret = tgz_write(fname, &src, out, entry, link, &tgz);
+		if (ret == -1)
+		{
+			message("Could not copy %s.\n", fname);
+			ret = BH_ERR_IO;
+		}
+		stats_entry(start);
+	}
+	if (ret == BH_OK && ((mode != BH_MODE_MAKE_TAR && tgz_finish(out, &tgz) == -1) ||
+		(mode == BH_MODE_MAKE_TAR && gather_flush(out) == -1)))
+		ret = BH_ERR_IO;
+	tgz_free(&tgz);
+
+	return ret;
+}
+
+int bh_convert(struct bh_archive *archive, int mode, struct bh_sink *sink, int jobs)
+{
+	struct gather out;
+	struct stat tar_stat;
+	int ret;
+
+	if (mode != BH_MODE_MAKE_TAR && mode != BH_MODE_MAKE_TGZ && mode != BH_MODE_MAKE_TGZ_SINGLE)
+		return BH_ERR_ARGUMENT;
+
+	// the tarball has to be a file for the workers to write into it in place,
+	// and for entries read out of order to go in the right place
+	if (mode == BH_MODE_MAKE_TAR && (jobs > 1 || archive->read_order) && sink->fd != -1 && fstat(sink->fd, &tar_stat) == 0 && S_ISREG(tar_stat.st_mode))
+		return tar_parallel(&archive->zip, &archive->base, &archive->table, archive->read_order,
+			archive->order != BH_ORDER_DIRECTORY, sink->fd, jobs > 1 ? jobs : 1) == -1 ? BH_ERR_IO : BH_OK;
+
+	// small entries go out together, see gather_flush()
+	if (gather_init_sink(&out, sink, GATHER_BYTES) == -1)
+		return BH_ERR_MEMORY;
+	ret = convert_table(archive, mode, &out);
+	gather_free(&out);
+
+	return ret;
+}
+
+int bh_convert_entry(struct bh_archive *archive, const struct bh_entry *entry, int mode, struct bh_sink *sink)
+{
+	struct zip_entry *e;
+	struct zip_source src;
+	struct gather out;
+	unsigned char fname[512];
+	int ret;
+
+	if (entry->index >= archive->table.count || (mode != BH_MODE_MAKE_TAR && mode != BH_MODE_EXTRACT))
+		return BH_ERR_ARGUMENT;
+
+	e = &archive->table.entries[entry->index];
+	if (entry_name(&archive->table, e, mode, fname, sizeof(fname)) == -1)
+		return BH_ERR_NAME;
+	if (zip_source_entry(&src, &archive->zip, e) == -1)
+		return BH_ERR_DAMAGED;
+	if (gather_init_sink(&out, sink, mode == BH_MODE_EXTRACT ? 0 : GATHER_BYTES) == -1)
+		return BH_ERR_MEMORY;
+
+	if (mode == BH_MODE_MAKE_TAR)
+		ret = tar_write(fname, &src, &out, e, NULL) == -1 || gather_flush(&out) == -1 ? -1 : 0;
+	else
+		ret = gz_write(&src, &out, e);
+	gather_free(&out);
+
+	return ret == -1 ? BH_ERR_IO : BH_OK;
+}
+
+int bh_extract(struct bh_archive *archive, int jobs, int flags)
+{
+	struct zip_table *table = &archive->table;
+	struct extract_job job = {&archive->zip, table, archive->read_order, NULL};
+	uint32_t n;
+	int ret = -2;
+
+#ifdef BH_IO_URING
+	// its batches write stored entries as they are. -2 means there's no 
+	// io_uring on this kernel, and it's done the usual way.
+	if ((flags & BH_EXTRACT_URING) && !compress_level)
+		ret = uring_extract(&archive->zip, table, archive->read_order);
+#else
+	(void)flags;
+#endif
+
+	if (ret == -2 && archive->order != BH_ORDER_DIRECTORY)
+	{
+		job.ahead = calloc(jobs > 1 ? jobs : 1, sizeof(struct read_ahead));
+		if (!job.ahead)
+			return BH_ERR_MEMORY;
+	}
+
+	// every entry is independent, and all reads are positional
+	if (ret == -2 && jobs > 1)
+		ret = pool_run(jobs, table->count, extract_job, &job);
+	else if (ret == -2)
+		for (n = 0, ret = 0; n < table->count; n++)
+			if (extract_job(&job, n, 0) == -1)
+				ret = -1; // the rest still get extracted, as on the pool
+
+	free(job.ahead);
+
+	// a link whose entry failed gets that entry copied instead
+	if (extract_links(&job) == -1)
+		ret = -1;
+
+	return ret == -1 ? BH_ERR_IO : BH_OK;
+}
+
+int bh_convert_stream(int zip_fd, int mode, int tar_fd, struct bh_filter *filter)
+{
+	struct name_filter none = {0}, *f = filter ? filter_ready(filter) : &none;
+
+	if (mode != BH_MODE_MAKE_TAR && mode != BH_MODE_MAKE_TGZ && mode != BH_MODE_MAKE_TGZ_SINGLE && mode != BH_MODE_EXTRACT)
+		return BH_ERR_ARGUMENT;
+	if (!f)
+		return BH_ERR_MEMORY;
+
+	return zip_stream_convert(zip_fd, tar_fd, mode, f) == -1 ? BH_ERR_DAMAGED : BH_OK;
+}
+
+int bh_reverse(int tar_fd, int zip_fd)
+{
+	return tar_to_zip(tar_fd, zip_fd) == -1 ? BH_ERR_IO : BH_OK;
+}
+
+int bh_write_index(struct bh_archive *archive, int mode, int fd)
+{
+	// the offsets come from the sizes in the zip, which compression changes
+	if ((mode != BH_MODE_MAKE_TAR && mode != BH_MODE_MAKE_TGZ) || (mode == BH_MODE_MAKE_TGZ && compress_level))
+		return BH_ERR_ARGUMENT;
+	return index_write(fd, &archive->table, mode) == -1 ? BH_ERR_IO : BH_OK;
+}
+
+int bh_verify_start(struct bh_archive *archive, int level, int threads)
+{
+	if (level != BH_VERIFY_STORED && level != BH_VERIFY_INFLATE)
+		return BH_ERR_ARGUMENT;
+	if (threads < 1)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (verify_start(&archive->verify, &archive->zip, &archive->table, level, threads) == -1)
+	{
+		verify_finish(&archive->verify);
+		return BH_ERR_MEMORY;
+	}
+
+	return BH_OK;
+}
+
+int bh_verify_finish(struct bh_archive *archive)
+{
+	return verify_finish(&archive->verify) == -1 ? BH_ERR_DAMAGED : BH_OK;
+}
+
+// Each worker of a batch converts whole zips, one at a time, and keeps its 
+// gather arena from one to the next
+struct batch_job
+{
+	struct bh_batch *items;
+	int mode;
+	struct name_filter *filter;
+	struct gather *out; // one per worker
+};
+
+static int batch_job(void *arg, uint32_t index, int worker)
+{
+	struct batch_job *job = arg;
+	struct bh_batch *item = &job->items[index];
+	struct gather *out = &job->out[worker];
+	struct bh_archive archive;
+	uint64_t t;
+	int tar_fd;
+
+	item->status = archive_open(&archive, item->zip_path, item->flags);
+	if (item->status != BH_OK)
+		return 0;
+	if (job->filter && filter_active(job->filter))
+		zip_filter_table(&archive.table, job->filter);
+
+	t = stats_now();
+	tar_fd = open(item->tar_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	stats_add(STAT_OPEN, t, 0);
+	if (tar_fd == -1)
+		item->status = BH_ERR_IO;
+	else
+	{
+		out->fd = tar_fd;
+		item->status = convert_table(&archive, job->mode, out);
+		out->count = 0;
+		out->bytes = 0;
+		out->arena_used = 0;
+
+		t = stats_now();
+		if (close(tar_fd) == -1 && item->status == BH_OK)
+			item->status = BH_ERR_IO;
+		stats_add(STAT_OPEN, t, 0);
+	}
+	archive_close(&archive);
+
+	// one bad zip doesn't stop the rest
+	return 0;
+}
+
+int bh_batch(struct bh_batch *items, uint32_t count, int mode, struct bh_filter *filter, int jobs)
+{
+	struct batch_job job = {items, mode, NULL, NULL};
+	uint32_t n;
+	int i, ret;
+
+	if (mode != BH_MODE_MAKE_TAR && mode != BH_MODE_MAKE_TGZ && mode != BH_MODE_MAKE_TGZ_SINGLE)
+		return BH_ERR_ARGUMENT;
+	if (filter && !(job.filter = filter_ready(filter)))
+		return BH_ERR_MEMORY;
+
+	if (jobs < 1)
+		jobs = 1;
+	if ((uint32_t)jobs > count)
+		jobs = count ? count : 1;
+	job.out = calloc(jobs, sizeof(struct gather));
+	if (!job.out)
+		return BH_ERR_MEMORY;
+	for (i = 0, ret = BH_OK; i < jobs && ret == BH_OK; i++)
+		if (gather_init(&job.out[i], -1, GATHER_BYTES) == -1)
+			ret = BH_ERR_MEMORY;
+
+	// every job sets its own status, unless the pool can't be started
+	for (n = 0; n < count; n++)
+		items[n].status = BH_ERR_MEMORY;
+	if (ret == BH_OK)
+		pool_run(jobs, count, batch_job, &job);
+
+	for (i = 0; i < jobs; i++)
+		gather_free(&job.out[i]);
+	free(job.out);
+
+	for (n = 0; n < count && ret == BH_OK; n++)
+		ret = items[n].status;
+
+	return ret;
+}
+
+// ---------------------- library interface end ------------------
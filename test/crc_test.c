@@ -0,0 +1,144 @@
+// crc_test - checks every crc kernel this cpu can run against the bytewise
+// one, and crc_combine() against the crc of a whole buffer.
+//
+//	crc_test [seed]
+//
+// The kernels are static, so libbaghand.c is built into this file. Every
+// kernel gets all lengths up to CRC_TEST_SHORT at every misalignment up to
+// 64 bytes, then random lengths, misalignments and starting crcs. Prints
+// one line per kernel and exits 1 if any result differs.
+
+#include "../libbaghand.c"
+
+#define CRC_TEST_BUFFER (256 * 1024)
+#define CRC_TEST_SHORT 1024 // every length up to this
+#define CRC_TEST_RANDOM 5000 // then this many random ones
+#define CRC_TEST_ALIGN 64
+
+struct crc_kernel
+{
+	const char *name;
+	uint32_t (*crc)(uint32_t c, const unsigned char *buf, uint64_t len);
+};
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t test_random(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ULL;
+}
+
+// Mostly short lengths, where the kernels switch between their loops and
+// tails, and now and then one that runs to the end of the buffer
+static uint64_t test_length(uint64_t max)
+{
+	switch (test_random() % 4)
+	{
+		case 0:
+			return test_random() % 512;
+		case 1:
+			return test_random() % 8192;
+		default:
+			return test_random() % (max + 1);
+	}
+}
+
+static int check(const struct crc_kernel *kernel, const unsigned char *buf, uint64_t len, uint32_t c)
+{
+	uint32_t want = crc32_bytewise(c, buf, len), got = kernel->crc(c, buf, len);
+
+	if (got == want)
+		return 0;
+	printf("%s: %08x for %llu bytes at alignment %u from %08x, should be %08x\n", kernel->name, got,
+		(unsigned long long)len, (unsigned)((uintptr_t)buf % CRC_TEST_ALIGN), c, want);
+	return 1;
+}
+
+static int check_kernel(const struct crc_kernel *kernel, const unsigned char *buf)
+{
+	uint64_t len, align, checks = 0;
+	int failed = 0, n;
+
+	for (len = 0; len <= CRC_TEST_SHORT && failed < 10; len++)
+		for (align = 0; align < CRC_TEST_ALIGN; align++, checks++)
+			failed += check(kernel, buf + align, len, 0xffffffff);
+
+	for (n = 0; n < CRC_TEST_RANDOM && failed < 10; n++, checks++)
+	{
+		align = test_random() % CRC_TEST_ALIGN;
+		failed += check(kernel, buf + align, test_length(CRC_TEST_BUFFER - align), (uint32_t)test_random());
+	}
+
+	printf("%-8s %llu checks, %s\n", kernel->name, (unsigned long long)checks, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+// crc_combine() of the two halves of a split buffer has to be the crc of
+// all of it, whichever kernel update_crc() ended up with
+static int check_combine(const unsigned char *buf)
+{
+	uint64_t len, split, n;
+	uint32_t a, b, whole;
+	int failed = 0;
+
+	for (n = 0; n < CRC_TEST_RANDOM && failed < 10; n++)
+	{
+		len = test_length(CRC_TEST_BUFFER);
+		split = len ? test_random() % (len + 1) : 0;
+		whole = crc(buf, len);
+		a = crc(buf, split);
+		b = crc(buf + split, len - split);
+		if (crc_combine(a, b, len - split) != whole)
+		{
+			printf("crc_combine: %08x for %llu + %llu bytes, should be %08x\n", crc_combine(a, b, len - split),
+				(unsigned long long)split, (unsigned long long)(len - split), whole);
+			failed++;
+		}
+	}
+
+	printf("%-8s %llu checks, %s\n", "combine", (unsigned long long)n, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	struct crc_kernel kernels[4];
+	unsigned char *buf;
+	int count = 0, failed = 0, i;
+
+	if (argc > 1)
+		rng = strtoull(argv[1], NULL, 0) | 1;
+
+	kernels[count++] = (struct crc_kernel){"slice8", crc32_slice8};
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+	{
+		kernels[count++] = (struct crc_kernel){"pclmul", crc32_pclmul};
+		if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq"))
+			kernels[count++] = (struct crc_kernel){"vpclmul", crc32_vpclmul};
+	}
+#endif
+
+	buf = malloc(CRC_TEST_BUFFER + CRC_TEST_ALIGN);
+	if (!buf)
+		return 1;
+	for (i = 0; i < CRC_TEST_BUFFER + CRC_TEST_ALIGN; i++)
+		buf[i] = test_random();
+
+	// the reference itself, against the check value of the crc-32 catalogue
+	if ((crc32_bytewise(0xffffffff, (const unsigned char *)"123456789", 9) ^ 0xffffffff) != 0xcbf43926)
+	{
+		printf("bytewise: the check value is wrong\n");
+		failed++;
+	}
+
+	for (i = 0; i < count; i++)
+		failed += check_kernel(&kernels[i], buf);
+	failed += check_combine(buf);
+
+	free(buf);
+	return failed ? 1 : 0;
+}